@@ -0,0 +1,378 @@
+/*! @file
+  @brief
+  mrbwrite benchmark.
+
+  Starts the target simulator (simulator/mrbsim) on a pseudo-terminal,
+  writes generated .mrb files with MrbSession, and records handshake
+  time, command round trip time, throughput and CPU time as JSON.
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+
+#define APPLICATION_VERSION "1.0.0"
+
+#include <string.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTextStream>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <QDateTime>
+#include <QSysInfo>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QFile>
+#include <QtEndian>
+
+#include "mrbbench.h"
+#include "mrbsession.h"
+
+
+//================================================================
+/*! parse a comma separated number list.
+*/
+static QList<int> to_int_list( const QString &s )
+{
+  QList<int> ret;
+  foreach( const QString &v, s.split(',', Qt::SkipEmptyParts) ) {
+    ret << v.trimmed().toInt();
+  }
+  return ret;
+}
+
+
+//================================================================
+/*! process CPU time (user + system) in microseconds.
+*/
+static qint64 cpu_time_us()
+{
+  struct rusage ru;
+  getrusage( RUSAGE_SELF, &ru );
+
+  return (qint64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+
+//================================================================
+/*! constructor
+
+  @param	argc	command line size
+  @param	argv	pointer to command line options
+*/
+MrbBench::MrbBench( int argc, char *argv[] )
+  : QCoreApplication( argc, argv ),
+    qout_(stdout),
+    opt_repeat_(1),
+    opt_latency_(0)
+{
+  setApplicationName("mrbbench");
+  setApplicationVersion(APPLICATION_VERSION);
+
+  /*
+    parse command line options.
+  */
+  QCommandLineParser parser;
+  parser.setApplicationDescription("mrbwrite benchmark. version " APPLICATION_VERSION);
+  parser.addHelpOption();
+  parser.addVersionOption();
+
+  QCommandLineOption simulatorOption("simulator",
+                                tr("Path to mrbsim. (default ../simulator/mrbsim)"),
+                                tr("path"));
+  parser.addOption(simulatorOption);
+
+  QCommandLineOption sizesOption("sizes",
+                                tr("Image sizes. (default 1024,8192,30000)"), tr("list"));
+  parser.addOption(sizesOption);
+
+  QCommandLineOption filesOption("files",
+                                tr("Number of files. (default 1,4)"), tr("list"));
+  parser.addOption(filesOption);
+
+  QCommandLineOption baudsOption("bauds",
+                                tr("Simulated baud rates. 0 is unlimited. (default 57600,115200,0)"),
+                                tr("list"));
+  parser.addOption(baudsOption);
+
+  QCommandLineOption repeatOption("repeat",
+                                tr("Repeat each case. (default 1)"), tr("n"));
+  parser.addOption(repeatOption);
+
+  QCommandLineOption latencyOption("latency",
+                                tr("Simulated response latency. (ms)"), tr("ms"));
+  parser.addOption(latencyOption);
+
+  QCommandLineOption compressOption("compress", tr("Send compressed bytecode."));
+  parser.addOption(compressOption);
+
+  QCommandLineOption labelOption("label",
+                                tr("Label of this run. (e.g. commit id)"), tr("label"));
+  parser.addOption(labelOption);
+
+  QCommandLineOption outputOption(QStringList() << "o" << "output",
+                                tr("Result file. (default bench_result.json)"), tr("file"));
+  parser.addOption(outputOption);
+
+  parser.process(*this);
+
+  opt_simulator_ = parser.isSet( simulatorOption ) ? parser.value( simulatorOption ) :
+    applicationDirPath() + "/../simulator/mrbsim";
+  opt_sizes_ = to_int_list( parser.isSet( sizesOption ) ?
+                            parser.value( sizesOption ) : QString("1024,8192,30000") );
+  opt_files_ = to_int_list( parser.isSet( filesOption ) ?
+                            parser.value( filesOption ) : QString("1,4") );
+  opt_bauds_ = to_int_list( parser.isSet( baudsOption ) ?
+                            parser.value( baudsOption ) : QString("57600,115200,0") );
+  if( parser.isSet( repeatOption ) ) {
+    opt_repeat_ = parser.value( repeatOption ).toInt();
+  }
+  if( parser.isSet( latencyOption ) ) {
+    opt_latency_ = parser.value( latencyOption ).toInt();
+  }
+  opt_compress_ = parser.isSet(compressOption);
+  opt_label_ = parser.value( labelOption );
+  opt_output_ = parser.isSet( outputOption ) ?
+    parser.value( outputOption ) : QString("bench_result.json");
+
+  /*
+    start user program main function run()
+  */
+  QTimer::singleShot(0, this, SLOT(run()));
+}
+
+
+//================================================================
+/*! user main function
+
+*/
+void MrbBench::run()
+{
+  int flag_error = 0;
+
+  if( !temp_dir_.isValid() ) {
+    qout_ << tr("Can't make a temporary directory.") << Qt::endl;
+    exit( 1 );
+    return;
+  }
+
+  qout_ << QString("%1 %2 %3 %4 %5 %6 %7 %8")
+    .arg("size", 6).arg("files", 5).arg("baud", 7).arg("total_ms", 9)
+    .arg("hshake_ms", 9).arg("rtt_us", 7).arg("bytes/s", 8).arg("cpu_ms", 7) << Qt::endl;
+
+  foreach( int baud, opt_bauds_ ) {
+    QString line = start_simulator( baud );
+    if( line.isEmpty() ) {
+      flag_error = 1;
+      break;
+    }
+
+    foreach( int n_files, opt_files_ ) {
+      foreach( int size, opt_sizes_ ) {
+        for( int n = 0; n < opt_repeat_; n++ ) {
+          if( bench( line, size, n_files, baud, n ) != 0 ) flag_error = 1;
+        }
+      }
+    }
+    stop_simulator();
+  }
+
+  if( write_results() != 0 ) flag_error = 1;
+  exit( flag_error );
+}
+
+
+//================================================================
+/*! start the target simulator.
+
+  @param	baud	simulated baud rate.
+  @return	device name of the simulator. (empty if error)
+*/
+QString MrbBench::start_simulator( int baud )
+{
+  QStringList args;
+  args << "--baud" << QString::number( baud );
+  if( opt_latency_ > 0 ) args << "--latency" << QString::number( opt_latency_ );
+
+  simulator_.setProcessChannelMode( QProcess::ForwardedErrorChannel );
+  simulator_.start( opt_simulator_, args );
+  if( !simulator_.waitForStarted() ) {
+    qout_ << tr("Can't start the simulator '%1'.").arg(opt_simulator_) << Qt::endl;
+    return QString();
+  }
+
+  // the first line is the device name.
+  while( !simulator_.canReadLine() ) {
+    if( !simulator_.waitForReadyRead( 5000 ) ) {
+      qout_ << tr("No response from the simulator.") << Qt::endl;
+      stop_simulator();
+      return QString();
+    }
+  }
+
+  return QString( simulator_.readLine() ).trimmed();
+}
+
+
+//================================================================
+/*! stop the target simulator.
+*/
+void MrbBench::stop_simulator()
+{
+  simulator_.terminate();
+  if( !simulator_.waitForFinished( 3000 ) ) {
+    simulator_.kill();
+    simulator_.waitForFinished();
+  }
+}
+
+
+//================================================================
+/*! make .mrb files for the benchmark.
+
+  The images have a valid RITE header, one IREP section and an END
+  section. The IREP body is pseudo random, and compresses about as
+  well as real bytecode.
+
+  @param	size	size of each file.
+  @param	n_files	number of files.
+  @return	filenames.
+*/
+QStringList MrbBench::make_images( int size, int n_files )
+{
+  const int HEADER_SIZE = 20 + 12;	// RITE header + IREP section header.
+  const int END_SIZE = 8;
+  QStringList ret;
+
+  size = qMax( size, HEADER_SIZE + END_SIZE );
+  for( int i = 0; i < n_files; i++ ) {
+    QString filename = temp_dir_.filePath( QString("bench_%1_%2.mrb").arg(size).arg(i) );
+    ret << filename;
+    if( QFile::exists( filename )) continue;
+
+    QByteArray image( size, '\0' );
+    char *p = image.data();
+    memcpy( p, "RITE0300", 8 );
+    qToBigEndian<quint32>( size, p + 8 );
+    memcpy( p + 12, "MATZ0000", 8 );
+    memcpy( p + 20, "IREP", 4 );
+    qToBigEndian<quint32>( size - 20 - END_SIZE, p + 24 );
+    memcpy( p + 28, "0300", 4 );
+
+    QRandomGenerator gen( size * 31 + i );
+    for( int j = HEADER_SIZE; j < size - END_SIZE; j++ ) {
+      p[j] = char( gen.bounded(2) ? gen.bounded(256) : gen.bounded(16) );
+    }
+
+    memcpy( p + size - END_SIZE, "END\0", 4 );
+    qToBigEndian<quint32>( END_SIZE, p + size - 4 );
+
+    QFile file( filename );
+    if( file.open( QIODevice::WriteOnly )) file.write( image );
+  }
+
+  return ret;
+}
+
+
+//================================================================
+/*! run one benchmark case.
+
+  @param	line	device name.
+  @param	size	size of each file.
+  @param	n_files	number of files.
+  @param	baud	simulated baud rate.
+  @param	n	repeat count.
+  @retval	int	0: no error
+*/
+int MrbBench::bench( const QString &line, int size, int n_files, int baud, int n )
+{
+  MrbSessionOption opt;
+  opt.baud_rate = (baud > 0) ? baud : 115200;
+  opt.compress = opt_compress_;
+  opt.force = true;		// write every time.
+  opt.quiet = true;
+  foreach( const QString &filename, make_images( size, n_files )) {
+    MrbImage image;
+    if( !image.load( filename )) {
+      qout_ << image.error_string() << Qt::endl;
+      return 1;
+    }
+    opt.images << image;
+  }
+
+  // reset the board. the program of the last run doesn't answer.
+  kill( simulator_.processId(), SIGUSR1 );
+
+  MrbSession session( line, opt );
+  qint64 cpu_us = cpu_time_us();
+  session.run();
+  cpu_us = cpu_time_us() - cpu_us;
+
+  const MrbSessionStats &st = session.stats();
+  qint64 rtt_avg_us = st.n_commands ? st.rtt_total_us / st.n_commands : 0;
+  qint64 bytes_per_sec = st.bytes_sent * 1000 / qMax<qint64>( st.transfer_ms, 1 );
+
+  QJsonObject r;
+  r["size"] = size;
+  r["files"] = n_files;
+  r["baud"] = baud;
+  r["latency_ms"] = opt_latency_;
+  r["compress"] = opt_compress_;
+  r["run"] = n;
+  r["result"] = session.result();
+  r["total_ms"] = session.elapsed_ms();
+  r["handshake_ms"] = st.connect_ms;
+  r["commands"] = st.n_commands;
+  r["rtt_avg_us"] = rtt_avg_us;
+  r["rtt_max_us"] = st.rtt_max_us;
+  r["bytes_sent"] = st.bytes_sent;
+  r["transfer_ms"] = st.transfer_ms;
+  r["bytes_per_sec"] = bytes_per_sec;
+  r["cpu_ms"] = cpu_us / 1000.0;
+  results_.append( r );
+
+  qout_ << QString("%1 %2 %3 %4 %5 %6 %7 %8")
+    .arg(size, 6).arg(n_files, 5).arg(baud, 7).arg(session.elapsed_ms(), 9)
+    .arg(st.connect_ms, 9).arg(rtt_avg_us, 7).arg(bytes_per_sec, 8)
+    .arg(cpu_us / 1000.0, 7, 'f', 1);
+  if( session.result() != 0 ) qout_ << tr("  ERROR");
+  qout_ << Qt::endl;
+
+  return session.result();
+}
+
+
+//================================================================
+/*! write the results to the --output file.
+
+  @retval	int	0: no error
+*/
+int MrbBench::write_results()
+{
+  QJsonObject root;
+  root["label"] = opt_label_;
+  root["date"] = QDateTime::currentDateTimeUtc().toString( Qt::ISODate );
+  root["host"] = QSysInfo::machineHostName();
+  root["cpu"] = QSysInfo::currentCpuArchitecture();
+  root["results"] = results_;
+
+  QFile file( opt_output_ );
+  if( !file.open( QIODevice::WriteOnly | QIODevice::Truncate )) {
+    qout_ << tr("Can't write '%1'.").arg(opt_output_) << Qt::endl;
+    return 1;
+  }
+  file.write( QJsonDocument( root ).toJson() );
+  qout_ << tr("Results are written to '%1'.").arg(opt_output_) << Qt::endl;
+
+  return 0;
+}
@@ -0,0 +1,64 @@
+/*! @file
+  @brief
+  mrbwrite benchmark.
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+#ifndef MRBBENCH_H
+#define MRBBENCH_H
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QTextStream>
+#include <QList>
+#include <QJsonArray>
+#include <QTemporaryDir>
+#include <QProcess>
+
+
+//================================================================
+/*! MrbBench class.
+
+  Runs MrbSession against the target simulator (mrbsim) over a range
+  of image sizes, file counts and baud rates, and reports the results
+  as JSON.
+*/
+class MrbBench : public QCoreApplication
+{
+  Q_OBJECT
+
+public:
+  MrbBench( int argc, char *argv[] );
+
+public slots:
+  void run();
+
+private:
+  QTextStream qout_;		//!< console output stream.
+  QString opt_simulator_;	//!< command line option --simulator
+  QList<int> opt_sizes_;	//!< command line option --sizes
+  QList<int> opt_files_;	//!< command line option --files
+  QList<int> opt_bauds_;	//!< command line option --bauds
+  int opt_repeat_;		//!< command line option --repeat
+  int opt_latency_;		//!< command line option --latency
+  bool opt_compress_;		//!< command line option --compress
+  QString opt_label_;		//!< command line option --label
+  QString opt_output_;		//!< command line option --output
+  QTemporaryDir temp_dir_;	//!< for the generated .mrb files.
+  QProcess simulator_;		//!< target simulator process.
+  QJsonArray results_;		//!< benchmark results.
+
+  QString start_simulator( int baud );
+  void stop_simulator();
+  QStringList make_images( int size, int n_files );
+  int bench( const QString &line, int size, int n_files, int baud, int n );
+  int write_results();
+};
+
+#endif
@@ -0,0 +1,23 @@
+######################################################################
+# mrbwrite benchmark.
+######################################################################
+
+TEMPLATE = app
+TARGET = mrbbench
+INCLUDEPATH += . ..
+
+# Input
+HEADERS += mrbbench.h
+SOURCES += main.cpp mrbbench.cpp
+include(../mrbwritelib.pri)
+
+
+#add
+QT -= gui
+QT += serialport
+CONFIG -= app_bundle
+CONFIG += console
+
+macx {
+    QMAKE_APPLE_DEVICE_ARCHS = x86_64 arm64
+}
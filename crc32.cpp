@@ -0,0 +1,54 @@
+/*! @file
+  @brief
+  CRC32 (IEEE 802.3) calculation.
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+
+#include "crc32.h"
+
+
+//================================================================
+/*! CRC table
+*/
+struct Crc32Table {
+  quint32 value[256];
+
+  Crc32Table() {
+    for( quint32 i = 0; i < 256; i++ ) {
+      quint32 c = i;
+      for( int j = 0; j < 8; j++ ) {
+        c = (c >> 1) ^ (0xedb88320 & -(c & 1));
+      }
+      value[i] = c;
+    }
+  }
+};
+
+
+//================================================================
+/*! calculate CRC32
+
+  @param	data	pointer to the data.
+  @param	size	data size.
+  @param	crc	CRC of the preceding data, to continue the calculation.
+  @return	CRC32 value.
+*/
+quint32 calc_crc32( const char *data, qint64 size, quint32 crc )
+{
+  static const Crc32Table table;
+  const quint8 *p = (const quint8 *)data;
+
+  crc = ~crc;
+  while( size-- > 0 ) {
+    crc = table.value[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
@@ -0,0 +1,20 @@
+/*! @file
+  @brief
+  CRC32 (IEEE 802.3) calculation.
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <QtGlobal>
+
+quint32 calc_crc32( const char *data, qint64 size, quint32 crc = 0 );
+
+#endif
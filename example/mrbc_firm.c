@@ -12,6 +12,7 @@
 
 //@cond
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 //@endcond
 
@@ -20,10 +21,75 @@
 #include "stm32f4_uart.h"
 
 
-#define VERSION_STRING   "mruby/c v3.3 RITE0300 MRBW1.2"
+#define VERSION_STRING   "mruby/c v3.3 RITE0300 MRBW1.2 baud zwrite hashprog bwrite mwrite crc read mrbw2"
+#define BAUD_TEST_PATTERN "UUUUUUUU0123456789abcdefABCDEF"
+#define BAUD_TEST_TIMEOUT_MS 500
+#define BAUD_CONFIRM "OK"
+#define BWRITE_STX		0x02
+#define BWRITE_MAX_BLOCKS	256
+#define BWRITE_TIMEOUT_MS	2000	// mrbwrite resends a lost block in half of it.
+#define WRITE_CHUNK_SIZE	512	// must be well below UART_SIZE_RXFIFO.
+#define READ_CHUNK_SIZE		512
+#define MRBW2_SOH		0x01
+#define MRBW2_REPLY_SIZE	2048	// response buffer in the frame mode.
+#define MRBW2_MAX_READ		1024	// 'read' size in the frame mode.
+#define MRBW2_MIN_PAYLOAD	256
+#define MRBW2_ESCAPE_GAP_MS	20	// quiet time around CR LF to leave the frame mode.
 
 const uint32_t IREP_START_ADDR = 0x08060000;	// This is sector 7
-const uint32_t IREP_END_ADDR   = 0x0807FFFF;	//  (see: cmd_clear function)
+const uint32_t IREP_END_ADDR   = 0x0807FFFF;	//  (see: TBL_IREP_SECTORS)
+
+//! FLASH sectors of the IREP region, in address order.
+//!  They must cover IREP_START_ADDR to IREP_END_ADDR.
+//!  e.g. sector 6 and 7: IREP_START_ADDR = 0x08040000, and
+//!    { FLASH_SECTOR_6, 0x08040000, 0x20000 },
+static const struct IREP_SECTOR_T {
+  uint32_t sector;
+  uint32_t addr;
+  uint32_t size;
+
+} TBL_IREP_SECTORS[] = {
+  { FLASH_SECTOR_7, 0x08060000, 0x20000 },
+};
+
+static const int NUM_IREP_SECTORS = sizeof(TBL_IREP_SECTORS)/sizeof(struct IREP_SECTOR_T);
+
+//! program directory slot.
+struct IREP_DIR_SLOT_T {
+  uint32_t offset;		//!< offset from IREP_START_ADDR. (0xFFFFFFFF: empty)
+  uint32_t size;		//!< program size.
+  uint32_t crc;			//!< CRC32 of the program.
+  uint32_t flags;		//!< DIR_SLOT_LIVE, or 0 if deleted.
+};
+
+//! program directory at the end of the IREP region.
+//!  Slots are appended as programs are written, and deleted by
+//!  clearing the flags, so that it is updated without an erase.
+struct IREP_DIR_T {
+  char magic[4];		//!< DIR_MAGIC if valid.
+  uint32_t reserved[3];
+  struct IREP_DIR_SLOT_T slot[63];
+};
+
+#define DIR_MAGIC	"PDIR"
+#define DIR_EMPTY	0xFFFFFFFF
+#define DIR_SLOT_LIVE	0xFFFFFFFF
+#define NUM_DIR_SLOTS	(int)(sizeof(((struct IREP_DIR_T *)0)->slot) / sizeof(struct IREP_DIR_SLOT_T))
+#define IREP_DIR_ADDR	(IREP_END_ADDR + 1 - sizeof(struct IREP_DIR_T))
+#define IREP_DIR	((const struct IREP_DIR_T *)IREP_DIR_ADDR)
+
+//! a program found by next_program().
+struct PROGRAM_T {
+  const uint8_t *addr;		//!< top of the RITE header.
+  unsigned int size;		//!< program size.
+  const struct IREP_DIR_SLOT_T *slot;	//!< directory slot. (NULL if scanned)
+};
+
+//! iterator for next_program(). (zero clear at first)
+struct PROGRAM_ITER_T {
+  int slot;			//!< next directory slot.
+  uint32_t addr;		//!< next address to scan.
+};
 
 static const char RITE[4] = "RITE";
 static const char WHITE_SPACE[] = " \t\r\n\f\v";
@@ -31,8 +97,13 @@ static const char WHITE_SPACE[] = " \t\r\n\f\v";
 
 #define STRM_READ(buf, len)	uart_read(UART_HANDLE_CONSOLE, buf, len)
 #define STRM_GETS(buf, size)	uart_gets(UART_HANDLE_CONSOLE, buf, size)
-#define STRM_PUTS(buf)		uart_write(UART_HANDLE_CONSOLE, buf, strlen(buf))
+#define STRM_CAN_READ_LINE()	uart_can_read_line(UART_HANDLE_CONSOLE)
+#define STRM_AVAILABLE()	uart_bytes_available(UART_HANDLE_CONSOLE)
+#define STRM_PUTS(buf)		strm_write(buf, strlen(buf))
+#define STRM_WRITE(buf, len)	strm_write(buf, len)
 #define STRM_RESET()		uart_clear_rx_buffer(UART_HANDLE_CONSOLE)
+#define STRM_SET_BAUD(baud)	uart_set_baudrate(UART_HANDLE_CONSOLE, baud)
+#define STRM_GET_BAUD()		(UART_HANDLE_CONSOLE->hal_uart->Init.BaudRate)
 #define SYSTEM_RESET()		HAL_NVIC_SystemReset()
 
 static int cmd_help();
@@ -42,85 +113,258 @@ static int cmd_execute();
 static int cmd_clear();
 static int cmd_write();
 static int cmd_showprog();
+static int cmd_baud();
+static int cmd_zwrite();
+static int cmd_hashprog();
+static int cmd_bwrite();
+static int cmd_mwrite();
+static int cmd_crc();
+static int cmd_read();
+static int cmd_mrbw2();
+static int cmd_data();
 
 
 static uint32_t irep_write_addr_;	//!< IREP file write point.
+static uint32_t irep_erased_addr_;	//!< FLASH is erased up to here from the write point.
+static uint32_t console_baud_;		//!< console baud rate before 'baud' command.
+
+//! 'write' in progress.
+static struct WRITE_STATE_T {
+  const uint8_t *addr;		//!< top of the program.
+  int size;			//!< program size. (0: not writing)
+  int offset;			//!< bytes received.
+  const char *error;		//!< error response, or NULL.
+} write_;
+
+//! MRBW2 frame mode. (see receive_frame)
+static int frame_mode_;			//!< in the frame mode.
+static uint8_t frame_seq_;		//!< seq of the request being executed.
+static uint8_t *frame_data_;		//!< binary data after the command line.
+static int frame_data_len_;
+static uint8_t *reply_buf_;		//!< response buffer. (NULL: write to the UART)
+static int reply_len_;
+
+//! command flags.
+#define CMD_TEXT_ONLY	0x01	//!< reads raw data from the stream.
 
 //! command table.
 static struct COMMAND_T {
   const char *command;
   int (*function)();
+  int flags;
 
 } const TBL_COMMANDS[] = {
-  {"help",	cmd_help },
-  {"version",	cmd_version },
-  {"reset",	cmd_reset },
-  {"execute",	cmd_execute },
-  {"clear",	cmd_clear },
-  {"write",	cmd_write },
-  {"showprog",	cmd_showprog },
+  {"help",	cmd_help,	0 },
+  {"version",	cmd_version,	0 },
+  {"reset",	cmd_reset,	0 },
+  {"execute",	cmd_execute,	0 },
+  {"clear",	cmd_clear,	0 },
+  {"write",	cmd_write,	0 },
+  {"showprog",	cmd_showprog,	0 },
+  {"baud",	cmd_baud,	CMD_TEXT_ONLY },
+  {"zwrite",	cmd_zwrite,	CMD_TEXT_ONLY },
+  {"hashprog",	cmd_hashprog,	0 },
+  {"bwrite",	cmd_bwrite,	CMD_TEXT_ONLY },
+  {"mwrite",	cmd_mwrite,	CMD_TEXT_ONLY },
+  {"crc",	cmd_crc,	0 },
+  {"read",	cmd_read,	0 },
+  {"mrbw2",	cmd_mrbw2,	CMD_TEXT_ONLY },
+  {"data",	cmd_data,	0 },
 };
 
 static const int NUM_TBL_COMMANDS = sizeof(TBL_COMMANDS)/sizeof(struct COMMAND_T);
 
 
 //================================================================
-/*! command 'help'
+/*! get the IREP file size from the RITE header.
+
+  @param  addr	pointer to the RITE header.
+  @return	size (bytes).
 */
-static int cmd_help(void)
+static unsigned int get_irep_size( const uint8_t *addr )
 {
-  STRM_PUTS("+OK\r\nCommands:\r\n");
+  unsigned int size = 0;
+  for( int i = 0; i < 4; i++ ) {
+    size = (size << 8) | addr[8 + i];
+  }
 
-  for( int i = 0; i < NUM_TBL_COMMANDS; i++ ) {
-    STRM_PUTS("  ");
-    STRM_PUTS(TBL_COMMANDS[i].command);
-    STRM_PUTS("\r\n");
+  return size;
+}
+
+
+//================================================================
+/*! calculate CRC32. (IEEE 802.3)
+*/
+static uint32_t calc_crc32( const uint8_t *p, int size )
+{
+  uint32_t crc = 0xffffffff;
+
+  while( size-- > 0 ) {
+    crc ^= *p++;
+    for( int i = 0; i < 8; i++ ) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
   }
-  STRM_PUTS("+DONE\r\n");
-  return 0;
+
+  return ~crc;
 }
 
 
 //================================================================
-/*! command 'version'
+/*! make 8 digits hex string.
+
+  @param  buf	output buffer. (9 bytes or more)
+  @param  val	value.
 */
-static int cmd_version(void)
+static void to_hex8( char *buf, uint32_t val )
 {
-  STRM_PUTS("+OK " VERSION_STRING "\r\n");
-  return 0;
+  static const char HEX[] = "0123456789abcdef";
+
+  for( int i = 7; i >= 0; i-- ) {
+    buf[i] = HEX[val & 0x0f];
+    val >>= 4;
+  }
+  buf[8] = '\0';
 }
 
 
 //================================================================
-/*! command 'reset'
+/*! write data to the console, or to the response buffer in the frame mode.
+
+  @param  buf	pointer to data.
+  @param  len	data size.
+  @return int	written size.
 */
-static int cmd_reset(void)
+static int strm_write( const void *buf, int len )
 {
-  SYSTEM_RESET();
+  if( reply_buf_ == NULL ) return uart_write(UART_HANDLE_CONSOLE, buf, len);
+
+  if( len > MRBW2_REPLY_SIZE - reply_len_ ) len = MRBW2_REPLY_SIZE - reply_len_;
+  memcpy( reply_buf_ + reply_len_, buf, len );
+  reply_len_ += len;
+
+  return len;
+}
+
+
+//================================================================
+/*! send the collected response as a frame. (frame mode)
+
+  frame: SOH(0x01) seq(1) len(2) hdr_chk(1) payload(len) crc32(4)
+    multi-byte values are big endian.
+    hdr_chk = ~(seq ^ len[0] ^ len[1])
+*/
+static void send_reply(void)
+{
+  if( reply_buf_ == NULL ) return;
+
+  uint8_t *p = reply_buf_;
+  int len = reply_len_;
+  reply_buf_ = NULL;
+
+  uint8_t hdr[5] = { MRBW2_SOH, frame_seq_, len >> 8, len };
+  hdr[4] = ~(hdr[1] ^ hdr[2] ^ hdr[3]);
+  uint32_t c = calc_crc32( p, len );
+  uint8_t crc[4] = { c >> 24, c >> 16, c >> 8, c };
+
+  STRM_WRITE( hdr, sizeof(hdr) );
+  STRM_WRITE( p, len );
+  STRM_WRITE( crc, sizeof(crc) );
+}
+
+
+//================================================================
+/*! read data with timeout.
+
+  @param  buf		pointer to buffer.
+  @param  size		size to read.
+  @param  timeout_ms	maximum idle time. (ms)
+  @return int		0 if no error, -1 if timeout.
+*/
+static int strm_read_timeout( void *buf, int size, uint32_t timeout_ms )
+{
+  uint8_t *p = buf;
+  uint32_t t0 = HAL_GetTick();
+
+  while( size > 0 ) {
+    int n = STRM_AVAILABLE();
+    if( n == 0 ) {
+      if( HAL_GetTick() - t0 >= timeout_ms ) return -1;
+      continue;
+    }
+    if( n > size ) n = size;
+
+    STRM_READ( p, n );
+    p += n;
+    size -= n;
+    t0 = HAL_GetTick();
+  }
+
   return 0;
 }
 
 
 //================================================================
-/*! command 'execute'
+/*! find the IREP sector that contains the address.
+
+  @param  addr	FLASH address.
+  @return	pointer to the sector, or NULL if out of the region.
 */
-static int cmd_execute(void)
+static const struct IREP_SECTOR_T *find_sector( uint32_t addr )
 {
-  STRM_PUTS("+OK Execute mruby/c.\r\n");
-  return 1;	// to execute VM.
+  for( int i = 0; i < NUM_IREP_SECTORS; i++ ) {
+    const struct IREP_SECTOR_T *sector = &TBL_IREP_SECTORS[i];
+    if( sector->addr <= addr && addr < sector->addr + sector->size ) return sector;
+  }
+
+  return NULL;
 }
 
 
 //================================================================
-/*! command 'clear'
+/*! end address of the program area in the sector.
+
+  @param  sector	IREP sector.
+  @return		end address. (the program directory is excluded)
+*/
+static uint32_t sector_data_end( const struct IREP_SECTOR_T *sector )
+{
+  uint32_t end = sector->addr + sector->size;
+
+  return (end > IREP_DIR_ADDR) ? IREP_DIR_ADDR : end;
+}
+
+
+//================================================================
+/*! check that the FLASH is blank. (erased)
+
+  @param  addr	start address. (4 byte aligned)
+  @param  end	end address.
+  @return	1 if blank.
+*/
+static int is_blank( uint32_t addr, uint32_t end )
+{
+  for( ; addr < end; addr += 4 ) {
+    if( *(const uint32_t *)addr != 0xFFFFFFFF ) return 0;
+  }
+
+  return 1;
+}
+
+
+//================================================================
+/*! erase a FLASH sector.
+
+  @param  sector	sector to erase.
+  @return		HAL status.
 */
-static int cmd_clear(void)
+static HAL_StatusTypeDef erase_sector( const struct IREP_SECTOR_T *sector )
 {
   HAL_FLASH_Unlock();
 
   FLASH_EraseInitTypeDef erase = {
     .TypeErase = FLASH_TYPEERASE_SECTORS,
-    .Sector = FLASH_SECTOR_7,
+    .Sector = sector->sector,
     .NbSectors = 1,
     .VoltageRange = FLASH_VOLTAGE_RANGE_3,  // Device operating range: 2.7V to 3.6V
   };
@@ -128,179 +372,1219 @@ static int cmd_clear(void)
   HAL_StatusTypeDef sts = HAL_FLASHEx_Erase(&erase, &error);
   HAL_FLASH_Lock();
 
-  if( sts == HAL_OK && error == 0xFFFFFFFF ) {
-    STRM_PUTS("+OK\r\n");
-  } else {
-    STRM_PUTS("-ERR\r\n");
-  }
+  if( sts == HAL_OK && error != 0xFFFFFFFF ) sts = HAL_ERROR;
 
-  irep_write_addr_ = IREP_START_ADDR;
-  return 0;
+  return sts;
 }
 
 
 //================================================================
-/*! command 'write'
+/*! program data to FLASH.
+
+  @param  addr	FLASH address. (4 byte aligned)
+  @param  data	pointer to the data.
+  @param  size	data size. (multiple of 4)
+  @return	HAL status.
 */
-static int cmd_write( void *buffer, int buffer_size )
+static HAL_StatusTypeDef flash_program( uint32_t addr, const void *data, int size )
 {
-  char *token = strtok( NULL, WHITE_SPACE );
-  if( token == NULL ) {
-    STRM_PUTS("-ERR\r\n");
-    return -1;
-  }
+  HAL_StatusTypeDef sts = HAL_OK;
+  const uint8_t *p = data;
+  uint32_t end = addr + size;
 
-  // check size
-  int size = mrbc_atoi(token, 10);
-  uint32_t irep_write_end = irep_write_addr_ + size;
-  if( (irep_write_end > IREP_END_ADDR) || (size > buffer_size) ) {
-    STRM_PUTS("-ERR IREP file size overflow.\r\n");
-    return -1;
-  }
+  HAL_FLASH_Unlock();
+  while( addr < end ) {
+    uint32_t word = p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
 
-  STRM_PUTS("+OK Write bytecode.\r\n");
+    sts = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, addr, word);
+    if( sts != HAL_OK ) break;
 
-  // get a bytecode.
-  uint8_t *p = buffer;
-  int n = size;
-  while (n > 0) {
-    int readed_size = STRM_READ( p, size );
-    p += readed_size;
-    n -= readed_size;
+    p += 4;
+    addr += 4;
   }
+  HAL_FLASH_Lock();
 
-  // check 'RITE' magick code.
-  p = buffer;
-  if( strncmp( (const char *)p, RITE, sizeof(RITE)) != 0 ) {
-    STRM_PUTS("-ERR No RITE code received.\r\n");
-    return -1;
-  }
+  return sts;
+}
 
-  // Write bytecode to FLASH.
-  HAL_FLASH_Unlock();
 
-  size += (-size & 3);		// align 4 byte.
-  irep_write_end = irep_write_addr_ + size;
+//================================================================
+/*! program data to FLASH at irep_write_addr_.
+
+  @param  p	pointer to the data.
+  @param  size	data size. (multiple of 4)
+  @return	HAL status.
+*/
+static HAL_StatusTypeDef program_flash( const uint8_t *p, int size )
+{
+  HAL_StatusTypeDef sts = flash_program( irep_write_addr_, p, size );
+  if( sts == HAL_OK ) irep_write_addr_ += size;
 
-  while( irep_write_addr_ < irep_write_end ) {
-    uint32_t data = p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+  return sts;
+}
 
-    HAL_StatusTypeDef sts;
-    sts = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, irep_write_addr_, data);
 
-    if( sts != HAL_OK ) {
-      STRM_PUTS("-ERR Flash write error.\r\n");
-      HAL_FLASH_Lock();
-      return -1;
-    }
+//================================================================
+/*! check the program directory is valid.
+*/
+static int dir_is_valid(void)
+{
+  return memcmp( IREP_DIR->magic, DIR_MAGIC, sizeof(IREP_DIR->magic) ) == 0;
+}
 
-    p += 4;
-    irep_write_addr_ += 4;
+
+//================================================================
+/*! get the next program.
+
+  Reads the program directory if it is valid, or walks the RITE
+  headers from IREP_START_ADDR if not.
+
+  @param  it	iterator.
+  @param  prog	found program.
+  @return	1 if found, 0 if no more programs.
+*/
+static int next_program( struct PROGRAM_ITER_T *it, struct PROGRAM_T *prog )
+{
+  if( dir_is_valid() ) {
+    while( it->slot < NUM_DIR_SLOTS ) {
+      const struct IREP_DIR_SLOT_T *slot = &IREP_DIR->slot[it->slot++];
+      if( slot->offset == DIR_EMPTY ) break;
+      if( slot->flags != DIR_SLOT_LIVE ) continue;	// deleted.
+
+      prog->addr = (const uint8_t *)(IREP_START_ADDR + slot->offset);
+      prog->size = slot->size;
+      prog->slot = slot;
+      return 1;
+    }
+    return 0;
   }
-  HAL_FLASH_Lock();
 
-  STRM_PUTS("+DONE\r\n");
+  if( it->addr == 0 ) it->addr = IREP_START_ADDR;
+  const uint8_t *addr = (const uint8_t *)it->addr;
+  if( it->addr + 12 > IREP_DIR_ADDR ||
+      strncmp( (const char *)addr, RITE, sizeof(RITE)) != 0 ) return 0;
 
-  return 0;
+  unsigned int size = get_irep_size( addr );
+  if( it->addr + size > IREP_DIR_ADDR ) return 0;
+
+  prog->addr = addr;
+  prog->size = size;
+  prog->slot = NULL;
+  it->addr += size + (-size & 3);	// align 4 byte.
+  return 1;
 }
 
 
 //================================================================
-/*! command 'showprog'
+/*! write a directory slot for the program.
+
+  @param  slot	empty slot.
+  @param  addr	top of the program.
+  @return	HAL status.
 */
-static int cmd_showprog(void)
+static HAL_StatusTypeDef dir_write_slot( const struct IREP_DIR_SLOT_T *slot, const uint8_t *addr )
 {
-  uint8_t *addr = (uint8_t *)IREP_START_ADDR;
-  int n = 0;
-  char buf[80];
-
-  STRM_PUTS("idx size offset\r\n");
-  while( strncmp( (const char *)addr, RITE, sizeof(RITE)) == 0 ) {
-    unsigned int size = 0;
-    for( int i = 0; i < 4; i++ ) {
-      size = (size << 8) | addr[8 + i];
-    }
-    mrbc_snprintf(buf, sizeof(buf), " %d  %-4d %p\r\n", n++, size, addr);
-    STRM_PUTS(buf);
+  unsigned int size = get_irep_size( addr );
+  struct IREP_DIR_SLOT_T s = {
+    .offset = (uint32_t)addr - IREP_START_ADDR,
+    .size = size,
+    .crc = calc_crc32( addr, size ),
+    .flags = DIR_SLOT_LIVE,
+  };
 
-    addr += size + (-size & 3);	// align 4 byte.
-  }
+  // the flags are left erased.
+  return flash_program( (uint32_t)slot, &s, offsetof(struct IREP_DIR_SLOT_T, flags) );
+}
 
-  int total = (IREP_END_ADDR - IREP_START_ADDR + 1);
-  int used = (uintptr_t)addr - IREP_START_ADDR;
-  int percent = 100 * used / total;
-  mrbc_snprintf(buf, sizeof(buf), "total %d / %d (%d%%)\r\n", used, total, percent);
-  STRM_PUTS(buf);
-  STRM_PUTS("+DONE\r\n");
 
-  return 0;
+//================================================================
+/*! invalidate the program directory. (back to walking the headers)
+*/
+static void dir_invalidate(void)
+{
+  static const uint32_t zero = 0;
+  flash_program( (uint32_t)IREP_DIR->magic, &zero, sizeof(zero) );
 }
 
 
 //================================================================
-/*! receive bytecode mode
+/*! add a program just written to the directory.
+
+  @param  addr	top of the program.
 */
-int receive_bytecode( void *buffer, int buffer_size )
+static void dir_append( const uint8_t *addr )
 {
-  char buf[50];
+  if( !dir_is_valid() ) return;
 
-  STRM_PUTS("+OK mruby/c\r\n");
+  for( int i = 0; i < NUM_DIR_SLOTS; i++ ) {
+    const struct IREP_DIR_SLOT_T *slot = &IREP_DIR->slot[i];
+    if( slot->offset != DIR_EMPTY ) continue;
 
-  while( 1 ) {
-    // get the command string.
-    if( STRM_GETS(buf, sizeof(buf)) < 0 ) {
-      STRM_RESET();
-      continue;
-    }
+    if( dir_write_slot( slot, addr ) != HAL_OK ) dir_invalidate();
+    return;
+  }
+
+  dir_invalidate();	// full.
+}
 
-    // split tokens.
-    char *token = strtok( buf, WHITE_SPACE );
-    if( token == NULL ) {
-      STRM_PUTS("+OK mruby/c\r\n");
+
+//================================================================
+/*! delete the programs after the first n from the directory.
+
+  @param  keep	number of programs to keep.
+*/
+static void dir_truncate( int keep )
+{
+  static const uint32_t zero = 0;
+
+  for( int i = 0; i < NUM_DIR_SLOTS; i++ ) {
+    const struct IREP_DIR_SLOT_T *slot = &IREP_DIR->slot[i];
+    if( slot->offset == DIR_EMPTY ) break;
+    if( slot->flags != DIR_SLOT_LIVE ) continue;
+    if( keep > 0 ) {
+      keep--;
       continue;
     }
+    flash_program( (uint32_t)&slot->flags, &zero, sizeof(zero) );
+  }
+}
 
-    // find command.
-    int i;
-    for( i = 0; i < NUM_TBL_COMMANDS; i++ ) {
-      if( strcmp( token, TBL_COMMANDS[i].command ) == 0 ) break;
-    }
-    if( i == NUM_TBL_COMMANDS ) {
-      STRM_PUTS("-ERR Illegal command. '");
-      STRM_PUTS(token);
-      STRM_PUTS("'\r\n");
-      continue;
+
+//================================================================
+/*! make the program directory from the programs before irep_write_addr_.
+
+  The directory area must be blank. It is made valid at the end, so
+  the programs are found by walking the headers until then.
+*/
+static void dir_rebuild(void)
+{
+  if( !is_blank( IREP_DIR_ADDR, IREP_END_ADDR + 1 )) return;
+
+  struct PROGRAM_ITER_T it = {0};
+  struct PROGRAM_T prog;
+  int i = 0;
+  while( next_program( &it, &prog )) {
+    if( (uint32_t)prog.addr >= irep_write_addr_ ) break;
+    if( i >= NUM_DIR_SLOTS ) return;		// too many. keep walking the headers.
+    if( dir_write_slot( &IREP_DIR->slot[i++], prog.addr ) != HAL_OK ) return;
+  }
+
+  flash_program( (uint32_t)IREP_DIR->magic, DIR_MAGIC, sizeof(IREP_DIR->magic) );
+}
+
+
+//================================================================
+/*! make sure the FLASH is erased from the write point up to the end.
+
+  The sectors are erased only when writing reaches them, and only if
+  they are not blank. The word after the end is erased as well, so
+  that no old program appears to follow the new one.
+  Call this before "+OK", since the DMA ring would overflow while
+  the CPU waits for an erase.
+
+  @param  end	end address of the data to write.
+  @return	HAL status.
+*/
+static HAL_StatusTypeDef prepare_flash( uint32_t end )
+{
+  end = ((end + 3) & ~3) + 4;
+  if( end > IREP_DIR_ADDR ) end = IREP_DIR_ADDR;
+
+  while( irep_erased_addr_ < end ) {
+    const struct IREP_SECTOR_T *sector = find_sector( irep_erased_addr_ );
+    if( sector == NULL ) return HAL_ERROR;
+
+    uint32_t sector_end = sector_data_end( sector );
+    if( !is_blank( irep_erased_addr_, sector_end )) {
+      // only a whole sector can be erased. (see cmd_clear)
+      if( irep_erased_addr_ != sector->addr ) return HAL_ERROR;
+      HAL_StatusTypeDef sts = erase_sector( sector );
+      if( sts != HAL_OK ) return sts;
+      if( sector_end == IREP_DIR_ADDR ) dir_rebuild();	// erased with the programs.
     }
+    irep_erased_addr_ = sector_end;
+  }
+
+  return HAL_OK;
+}
+
+
+//================================================================
+/*! command 'help'
+*/
+static int cmd_help(void)
+{
+  STRM_PUTS("+OK\r\nCommands:\r\n");
 
-    // execute command.
-    if( (TBL_COMMANDS[i].function)(buffer, buffer_size) == 1 ) break;
+  for( int i = 0; i < NUM_TBL_COMMANDS; i++ ) {
+    STRM_PUTS("  ");
+    STRM_PUTS(TBL_COMMANDS[i].command);
+    STRM_PUTS("\r\n");
   }
+  STRM_PUTS("+DONE\r\n");
+  return 0;
+}
 
+
+//================================================================
+/*! command 'version'
+*/
+static int cmd_version(void)
+{
+  STRM_PUTS("+OK " VERSION_STRING "\r\n");
   return 0;
 }
 
 
 //================================================================
-/*! pick up a task
+/*! command 'reset'
 */
-void * pickup_task( void *task )
+static int cmd_reset(void)
 {
-  uint8_t *addr = (uint8_t *)IREP_START_ADDR;
+  SYSTEM_RESET();
+  return 0;
+}
 
-  if( task ) {
-    if( strncmp( task, RITE, sizeof(RITE)) != 0 ) return 0;
 
-    addr = task;
-    unsigned int size = 0;
-    for( int i = 0; i < 4; i++ ) {
-      size = (size << 8) | addr[8 + i];
-    }
+//================================================================
+/*! command 'execute'
+*/
+static int cmd_execute(void)
+{
+  STRM_PUTS("+OK Execute mruby/c.\r\n");
+  send_reply();		// before the speed changes.
+  frame_mode_ = 0;
 
-    addr += size + (-size & 3);	// align 4 byte.
+  // back to the initial console speed for the user program.
+  if( console_baud_ != 0 ) {
+    STRM_SET_BAUD( console_baud_ );
+    console_baud_ = 0;
   }
 
-  if( strncmp( (const char *)addr, RITE, sizeof(RITE)) == 0 ) {
-    return addr;
+  return 1;	// to execute VM.
+}
+
+
+//================================================================
+/*! command 'clear'
+
+  'clear' erases all programs.
+  'clear n' keeps the first n programs, and erases the rest.
+
+  Only the sector at the write point is erased here, if it is not
+  blank. The following sectors are erased when writing reaches them.
+  (see prepare_flash)
+  The cleared programs are deleted from the program directory.
+*/
+static int cmd_clear( void *buffer, int buffer_size )
+{
+  char *token = strtok( NULL, WHITE_SPACE );
+  int keep = token ? mrbc_atoi(token, 10) : 0;
+
+  // find the end of the programs to keep.
+  uint32_t addr = IREP_START_ADDR;
+  struct PROGRAM_ITER_T it = {0};
+  struct PROGRAM_T prog;
+  for( int i = 0; i < keep; i++ ) {
+    if( !next_program( &it, &prog )) {
+      STRM_PUTS("-ERR No such program.\r\n");
+      return -1;
+    }
+    addr = (uint32_t)prog.addr + prog.size + (-prog.size & 3);	// align 4 byte.
+  }
+  irep_write_addr_ = addr;
+  irep_erased_addr_ = addr;
+
+  HAL_StatusTypeDef sts = HAL_OK;
+  const struct IREP_SECTOR_T *sector = find_sector( addr );
+  if( sector != NULL && addr < IREP_DIR_ADDR ) {
+    uint32_t sector_end = sector_data_end( sector );
+
+    if( !is_blank( addr, sector_end )) {
+      // erase the sector, keeping the programs in it.
+      int keep_size = addr - sector->addr;
+      if( keep_size > buffer_size ) {
+        STRM_PUTS("-ERR Programs to keep are too large.\r\n");
+        return -1;
+      }
+      memcpy( buffer, (const void *)sector->addr, keep_size );
+
+      sts = erase_sector( sector );
+      irep_write_addr_ = sector->addr;
+      if( sts == HAL_OK ) {
+        // write back the kept programs.
+        sts = program_flash( buffer, keep_size );
+      }
+    }
+    irep_erased_addr_ = sector_end;
+  }
+
+  // update the program directory.
+  if( dir_is_valid() ) {
+    dir_truncate( keep );
+  } else {
+    dir_rebuild();
+  }
+
+  if( sts == HAL_OK ) {
+    STRM_PUTS("+OK\r\n");
+  } else {
+    STRM_PUTS("-ERR\r\n");
+  }
+
+  return 0;
+}
+
+
+//================================================================
+/*! write received bytecode to FLASH.
+
+  @param  p	pointer to the bytecode.
+  @param  size	bytecode size.
+  @return int	0 if no error.
+*/
+static int write_bytecode( const uint8_t *p, int size )
+{
+  // check 'RITE' magick code.
+  if( strncmp( (const char *)p, RITE, sizeof(RITE)) != 0 ) {
+    STRM_PUTS("-ERR No RITE code received.\r\n");
+    return -1;
+  }
+
+  // Write bytecode to FLASH.
+  const uint8_t *addr = (const uint8_t *)irep_write_addr_;
+  size += (-size & 3);		// align 4 byte.
+  if( program_flash( p, size ) != HAL_OK ) {
+    STRM_PUTS("-ERR Flash write error.\r\n");
+    return -1;
+  }
+  dir_append( addr );
+
+  STRM_PUTS("+DONE\r\n");
+
+  return 0;
+}
+
+
+//================================================================
+/*! program a chunk of the bytecode being written.
+
+  The first chunk must start with the RITE header. After an error,
+  the rest is received and discarded.
+
+  @param  p	pointer to the chunk. (3 bytes after it are used for padding)
+  @param  len	chunk size. (multiple of 4, except the last chunk)
+*/
+static void write_chunk( uint8_t *p, int len )
+{
+  if( !write_.error && write_.offset == 0 &&
+      (len < (int)sizeof(RITE) || strncmp( (const char *)p, RITE, sizeof(RITE)) != 0) ) {
+    write_.error = "-ERR No RITE code received.\r\n";
+  }
+  write_.offset += len;
+  if( write_.error ) return;
+
+  int pad = -len & 3;		// align 4 byte.
+  memset( p + len, 0xff, pad );
+  if( program_flash( p, len + pad ) != HAL_OK ) {
+    write_.error = "-ERR Flash write error.\r\n";
+  }
+}
+
+
+//================================================================
+/*! finish the 'write' in progress, and send the result.
+
+  @return int	0 if no error.
+*/
+static int write_finish(void)
+{
+  write_.size = 0;
+  if( write_.error ) {
+    STRM_PUTS(write_.error);
+    return -1;
+  }
+  dir_append( write_.addr );
+
+  STRM_PUTS("+DONE\r\n");
+
+  return 0;
+}
+
+
+//================================================================
+/*! command 'write'
+
+  Receive bytecode in chunks, and program each chunk to FLASH while
+  the next one is arriving in the DMA ring buffer.
+  The size is limited by the FLASH region, not by the buffer.
+  In the frame mode, the chunks come in 'data' frames. (see cmd_data)
+*/
+static int cmd_write( void *buffer, int buffer_size )
+{
+  char *token = strtok( NULL, WHITE_SPACE );
+  if( token == NULL ) {
+    STRM_PUTS("-ERR\r\n");
+    return -1;
+  }
+
+  // check size
+  int size = mrbc_atoi(token, 10);
+  uint32_t irep_write_end = irep_write_addr_ + size;
+  int chunk_size = (buffer_size < WRITE_CHUNK_SIZE) ? (buffer_size & ~3) : WRITE_CHUNK_SIZE;
+  if( (irep_write_end > IREP_DIR_ADDR) || (size <= 0) || (chunk_size <= 0) ) {
+    STRM_PUTS("-ERR IREP file size overflow.\r\n");
+    return -1;
+  }
+
+  if( prepare_flash( irep_write_end ) != HAL_OK ) {
+    STRM_PUTS("-ERR Flash erase error.\r\n");
+    return -1;
+  }
+
+  STRM_PUTS("+OK Write bytecode.\r\n");
+
+  write_.addr = (const uint8_t *)irep_write_addr_;
+  write_.size = size;
+  write_.offset = 0;
+  write_.error = NULL;
+  if( frame_mode_ ) return 0;
+
+  // receive and program chunk by chunk.
+  while( write_.offset < size ) {
+    int len = size - write_.offset;
+    if( len > chunk_size ) len = chunk_size;
+    STRM_READ( buffer, len );
+    write_chunk( buffer, len );
+  }
+
+  return write_finish();
+}
+
+
+//================================================================
+/*! command 'data' (frame mode only)
+
+  data (offset) NUL (binary data)
+    Program the data of the 'write' in progress.
+
+  A frame that is already programmed is answered by "+OK" again, and
+  a frame after a lost one is answered by "-NAK (expected offset)",
+  so that the host can go back and resend from there.
+*/
+static int cmd_data(void)
+{
+  char *token = strtok( NULL, WHITE_SPACE );
+  if( token == NULL || !frame_mode_ || write_.size == 0 ) {
+    STRM_PUTS("-ERR Not writing.\r\n");
+    return -1;
+  }
+
+  int offset = mrbc_atoi(token, 10);
+  int len = frame_data_len_;
+  if( offset + len <= write_.offset ) {
+    STRM_PUTS("+OK\r\n");		// resent.
+    return 0;
+  }
+  if( offset != write_.offset ) {
+    char buf[20];
+    mrbc_snprintf(buf, sizeof(buf), "-NAK %d\r\n", write_.offset);
+    STRM_PUTS(buf);
+    return -1;
+  }
+  if( offset + len > write_.size || ((len & 3) && offset + len < write_.size) ) {
+    write_.size = 0;
+    STRM_PUTS("-ERR Illegal data size.\r\n");
+    return -1;
+  }
+
+  write_chunk( frame_data_, len );
+  if( write_.offset < write_.size ) {
+    STRM_PUTS("+OK\r\n");
+    return 0;
+  }
+
+  return write_finish();
+}
+
+
+//================================================================
+/*! command 'zwrite'
+
+  Receive LZSS compressed bytecode, and decompress it into the buffer.
+  The decoder uses the output as its window, so the RAM needed is
+  only the buffer that 'write' uses as well.
+*/
+static int cmd_zwrite( void *buffer, int buffer_size )
+{
+  char *token1 = strtok( NULL, WHITE_SPACE );
+  char *token2 = strtok( NULL, WHITE_SPACE );
+  if( token1 == NULL || token2 == NULL ) {
+    STRM_PUTS("-ERR\r\n");
+    return -1;
+  }
+
+  // check size
+  int size = mrbc_atoi(token1, 10);
+  int csize = mrbc_atoi(token2, 10);
+  uint32_t irep_write_end = irep_write_addr_ + size;
+  if( (irep_write_end > IREP_DIR_ADDR) || (size > buffer_size) || (csize <= 0) ) {
+    STRM_PUTS("-ERR IREP file size overflow.\r\n");
+    return -1;
+  }
+
+  if( prepare_flash( irep_write_end ) != HAL_OK ) {
+    STRM_PUTS("-ERR Flash erase error.\r\n");
+    return -1;
+  }
+
+  STRM_PUTS("+OK Write compressed bytecode.\r\n");
+
+  // receive and decompress.
+  uint8_t *p = buffer;
+  uint8_t *p_end = p + size;
+  int error = 0;
+
+  while( csize > 0 ) {
+    uint8_t flags;
+    STRM_READ( &flags, 1 );
+    csize--;
+
+    for( int i = 0; i < 8 && csize > 0; i++ ) {
+      if( flags & (1 << i) ) {		// literal
+        uint8_t ch;
+        STRM_READ( &ch, 1 );
+        csize--;
+        if( p < p_end ) *p++ = ch; else error = 1;
+        continue;
+      }
+
+      uint8_t m[2];			// match
+      if( csize < 2 ) {
+        STRM_READ( m, csize );
+        csize = 0;
+        error = 1;
+        break;
+      }
+      STRM_READ( m, 2 );
+      csize -= 2;
+
+      int dist = (m[0] | (m[1] >> 4) << 8) + 1;
+      int len = (m[1] & 0x0f) + 3;
+      if( dist > p - (uint8_t *)buffer || len > p_end - p ) {
+        error = 1;
+        continue;
+      }
+      while( len-- > 0 ) {
+        *p = *(p - dist);
+        p++;
+      }
+    }
+  }
+
+  if( error || p != p_end ) {
+    STRM_PUTS("-ERR Decompression error.\r\n");
+    return -1;
+  }
+
+  return write_bytecode( buffer, size );
+}
+
+
+//================================================================
+/*! receive data in numbered blocks with CRC32.
+
+  Each frame is acknowledged by "+ACK n" or "-NAK n", so that the host
+  resends only the failed blocks.
+
+  frame: STX(0x02) seq(2) len(2) hdr_chk(1) data(len) crc32(4)
+    multi-byte values are big endian.
+    hdr_chk = ~(seq[0] ^ seq[1] ^ len[0] ^ len[1])
+
+  @param  buffer	pointer to buffer.
+  @param  size		data size.
+  @param  block_size	block size.
+  @return int		0 if no error.
+*/
+static int receive_blocks( uint8_t *buffer, int size, int block_size )
+{
+  int n_blocks = (size + block_size - 1) / block_size;
+  uint32_t received[BWRITE_MAX_BLOCKS / 32] = {0};
+  int n_received = 0;
+  char buf[20];
+
+  while( n_received < n_blocks ) {
+    uint8_t hdr[6];
+
+    // find a frame header.
+    if( strm_read_timeout( hdr, 1, BWRITE_TIMEOUT_MS ) < 0 ) goto TIMEOUT;
+    if( hdr[0] != BWRITE_STX ) continue;
+    if( strm_read_timeout( hdr+1, 5, BWRITE_TIMEOUT_MS ) < 0 ) goto TIMEOUT;
+    if( (uint8_t)~(hdr[1] ^ hdr[2] ^ hdr[3] ^ hdr[4]) != hdr[5] ) continue;
+
+    int seq = hdr[1] << 8 | hdr[2];
+    int len = hdr[3] << 8 | hdr[4];
+    if( seq >= n_blocks ) continue;
+    if( len != ((seq == n_blocks-1) ? size - seq * block_size : block_size) ) continue;
+
+    // receive the block and its CRC.
+    uint8_t *p = buffer + seq * block_size;
+    uint8_t crc[4];
+    int done = received[seq / 32] & (1UL << (seq % 32));
+    if( done ) {
+      // already received. drop the duplicate.
+      while( len > 0 ) {
+        int n = (len < (int)sizeof(buf)) ? len : (int)sizeof(buf);
+        if( strm_read_timeout( buf, n, BWRITE_TIMEOUT_MS ) < 0 ) goto TIMEOUT;
+        len -= n;
+      }
+    } else {
+      if( strm_read_timeout( p, len, BWRITE_TIMEOUT_MS ) < 0 ) goto TIMEOUT;
+    }
+    if( strm_read_timeout( crc, 4, BWRITE_TIMEOUT_MS ) < 0 ) goto TIMEOUT;
+
+    if( !done ) {
+      uint32_t c = crc[0] << 24 | crc[1] << 16 | crc[2] << 8 | crc[3];
+      if( c != calc_crc32( p, len ) ) {
+        mrbc_snprintf(buf, sizeof(buf), "-NAK %d\r\n", seq);
+        STRM_PUTS(buf);
+        continue;
+      }
+      received[seq / 32] |= (1UL << (seq % 32));
+      n_received++;
+    }
+    mrbc_snprintf(buf, sizeof(buf), "+ACK %d\r\n", seq);
+    STRM_PUTS(buf);
+  }
+
+  return 0;
+
+ TIMEOUT:
+  STRM_PUTS("-ERR Timeout.\r\n");
+  return -1;
+}
+
+
+//================================================================
+/*! check the block size for receive_blocks().
+
+  @return int		0 if no error.
+*/
+static int check_block_size( int size, int block_size )
+{
+  int n_blocks = (block_size > 0) ? (size + block_size - 1) / block_size : 0;
+  if( n_blocks <= 0 || n_blocks > BWRITE_MAX_BLOCKS ) {
+    STRM_PUTS("-ERR Illegal block size.\r\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+//================================================================
+/*! command 'bwrite'
+
+  Receive bytecode in numbered blocks with CRC32.
+  (see receive_blocks)
+*/
+static int cmd_bwrite( void *buffer, int buffer_size )
+{
+  char *token1 = strtok( NULL, WHITE_SPACE );
+  char *token2 = strtok( NULL, WHITE_SPACE );
+  if( token1 == NULL || token2 == NULL ) {
+    STRM_PUTS("-ERR\r\n");
+    return -1;
+  }
+
+  // check size
+  int size = mrbc_atoi(token1, 10);
+  int block_size = mrbc_atoi(token2, 10);
+  uint32_t irep_write_end = irep_write_addr_ + size;
+  if( (irep_write_end > IREP_DIR_ADDR) || (size > buffer_size) || (size <= 0) ) {
+    STRM_PUTS("-ERR IREP file size overflow.\r\n");
+    return -1;
+  }
+  if( check_block_size( size, block_size ) != 0 ) return -1;
+
+  if( prepare_flash( irep_write_end ) != HAL_OK ) {
+    STRM_PUTS("-ERR Flash erase error.\r\n");
+    return -1;
+  }
+
+  STRM_PUTS("+OK Write bytecode.\r\n");
+
+  if( receive_blocks( buffer, size, block_size ) != 0 ) return -1;
+
+  return write_bytecode( buffer, size );
+}
+
+
+//================================================================
+/*! command 'mwrite'
+
+  Receive several bytecode files at once, and write them all.
+  The files are sent back-to-back, and each size is taken from its
+  RITE header. Only one status line is returned at the end.
+
+  mwrite (count) (total size) [block size]
+    If the block size is given, the data is sent in 'bwrite' frames.
+*/
+static int cmd_mwrite( void *buffer, int buffer_size )
+{
+  char *token1 = strtok( NULL, WHITE_SPACE );
+  char *token2 = strtok( NULL, WHITE_SPACE );
+  char *token3 = strtok( NULL, WHITE_SPACE );
+  if( token1 == NULL || token2 == NULL ) {
+    STRM_PUTS("-ERR\r\n");
+    return -1;
+  }
+
+  // check size
+  int count = mrbc_atoi(token1, 10);
+  int size = mrbc_atoi(token2, 10);
+  int block_size = token3 ? mrbc_atoi(token3, 10) : 0;
+  uint32_t irep_write_end = irep_write_addr_ + size + 3 * count;
+  if( (irep_write_end > IREP_DIR_ADDR) || (size > buffer_size) ||
+      (size <= 0) || (count <= 0) ) {
+    STRM_PUTS("-ERR IREP file size overflow.\r\n");
+    return -1;
+  }
+  if( token3 && check_block_size( size, block_size ) != 0 ) return -1;
+
+  if( prepare_flash( irep_write_end ) != HAL_OK ) {
+    STRM_PUTS("-ERR Flash erase error.\r\n");
+    return -1;
+  }
+
+  STRM_PUTS("+OK Write bytecode.\r\n");
+
+  // get all bytecodes.
+  if( token3 ) {
+    if( receive_blocks( buffer, size, block_size ) != 0 ) return -1;
+  } else {
+    STRM_READ( buffer, size );
+  }
+
+  // check all 'RITE' headers before writing.
+  uint8_t *p = buffer;
+  for( int i = 0; i < count; i++ ) {
+    if( (p + 12 > (uint8_t *)buffer + size) ||
+        strncmp( (const char *)p, RITE, sizeof(RITE)) != 0 ) {
+      STRM_PUTS("-ERR No RITE code received.\r\n");
+      return -1;
+    }
+    p += get_irep_size( p );
+  }
+  if( p != (uint8_t *)buffer + size ) {
+    STRM_PUTS("-ERR Size mismatch.\r\n");
+    return -1;
+  }
+
+  // Write bytecodes to FLASH.
+  //  the tail of each program is padded with 0xff in its own buffer,
+  //  not with the head of the next program.
+  p = buffer;
+  for( int i = 0; i < count; i++ ) {
+    unsigned int n = get_irep_size( p );
+    unsigned int body = n & ~3;
+    uint32_t tail = 0xffffffff;
+    const uint8_t *addr = (const uint8_t *)irep_write_addr_;
+    memcpy( &tail, p + body, n - body );
+    if( program_flash( p, body ) != HAL_OK ||
+        (n != body && program_flash( (const uint8_t *)&tail, 4 ) != HAL_OK) ) {
+      STRM_PUTS("-ERR Flash write error.\r\n");
+      return -1;
+    }
+    dir_append( addr );
+    p += n;
+  }
+
+  STRM_PUTS("+DONE\r\n");
+
+  return 0;
+}
+
+
+//================================================================
+/*! command 'showprog'
+*/
+static int cmd_showprog(void)
+{
+  uint32_t addr = IREP_START_ADDR;
+  struct PROGRAM_ITER_T it = {0};
+  struct PROGRAM_T prog;
+  int n = 0;
+  char buf[80];
+
+  STRM_PUTS("idx size offset\r\n");
+  while( next_program( &it, &prog )) {
+    mrbc_snprintf(buf, sizeof(buf), " %d  %-4d %p\r\n", n++, prog.size, prog.addr);
+    STRM_PUTS(buf);
+
+    addr = (uint32_t)prog.addr + prog.size + (-prog.size & 3);	// align 4 byte.
+  }
+
+  int total = (IREP_DIR_ADDR - IREP_START_ADDR);
+  int used = addr - IREP_START_ADDR;
+  int percent = 100 * used / total;
+  mrbc_snprintf(buf, sizeof(buf), "total %d / %d (%d%%)\r\n", used, total, percent);
+  STRM_PUTS(buf);
+  STRM_PUTS("+DONE\r\n");
+
+  return 0;
+}
+
+
+//================================================================
+/*! command 'hashprog'
+
+  Show the size and CRC32 of each stored program.
+  The CRC32 is taken from the program directory, if it is valid.
+*/
+static int cmd_hashprog(void)
+{
+  struct PROGRAM_ITER_T it = {0};
+  struct PROGRAM_T prog;
+  int n = 0;
+  char buf[40];
+
+  STRM_PUTS("+OK\r\n");
+  while( next_program( &it, &prog )) {
+    uint32_t crc = prog.slot ? prog.slot->crc : calc_crc32( prog.addr, prog.size );
+    int len = mrbc_snprintf(buf, sizeof(buf), "%d %d ", n++, prog.size);
+    to_hex8( buf + len, crc );
+    strcpy( buf + len + 8, "\r\n" );
+    STRM_PUTS(buf);
+  }
+  STRM_PUTS("+DONE\r\n");
+
+  return 0;
+}
+
+
+//================================================================
+/*! get the FLASH range of the 'crc' and 'read' commands.
+
+  (offset) (size)
+    offset is from IREP_START_ADDR.
+
+  @param  size	(out) size.
+  @return	top of the range, or NULL if error.
+*/
+static const uint8_t *get_flash_range( int *size )
+{
+  char *token1 = strtok( NULL, WHITE_SPACE );
+  char *token2 = strtok( NULL, WHITE_SPACE );
+  if( token1 == NULL || token2 == NULL ) {
+    STRM_PUTS("-ERR\r\n");
+    return NULL;
+  }
+
+  int offset = mrbc_atoi(token1, 10);
+  *size = mrbc_atoi(token2, 10);
+  if( offset < 0 || *size <= 0 ||
+      IREP_START_ADDR + offset + *size > IREP_DIR_ADDR ) {
+    STRM_PUTS("-ERR Out of range.\r\n");
+    return NULL;
+  }
+
+  return (const uint8_t *)(IREP_START_ADDR + offset);
+}
+
+
+//================================================================
+/*! command 'crc'
+
+  Calculate CRC32 of the FLASH contents, for verification.
+*/
+static int cmd_crc(void)
+{
+  int size;
+  const uint8_t *addr = get_flash_range( &size );
+  if( addr == NULL ) return -1;
+
+  char buf[20] = "+OK ";
+  to_hex8( buf + 4, calc_crc32( addr, size ));
+  strcpy( buf + 12, "\r\n" );
+  STRM_PUTS(buf);
+
+  return 0;
+}
+
+
+//================================================================
+/*! command 'read'
+
+  Send the FLASH contents as is, between "+OK" and "+DONE".
+*/
+static int cmd_read(void)
+{
+  int size;
+  const uint8_t *addr = get_flash_range( &size );
+  if( addr == NULL ) return -1;
+  if( frame_mode_ && size > MRBW2_MAX_READ ) {
+    STRM_PUTS("-ERR Too large for a frame.\r\n");
+    return -1;
+  }
+
+  STRM_PUTS("+OK\r\n");
+  while( size > 0 ) {
+    int n = (size < READ_CHUNK_SIZE) ? size : READ_CHUNK_SIZE;
+    STRM_WRITE( addr, n );
+    addr += n;
+    size -= n;
+  }
+  STRM_PUTS("+DONE\r\n");
+
+  return 0;
+}
+
+
+//================================================================
+/*! command 'baud'
+
+  Switch the console speed, then wait for the test pattern at the new
+  speed, and echo it. The new speed is kept only when the host
+  confirms that it got the echo. Otherwise revert to the former speed.
+*/
+static int cmd_baud(void)
+{
+  char buf[50];
+  uint32_t t0;
+  char *token = strtok( NULL, WHITE_SPACE );
+  if( token == NULL ) {
+    STRM_PUTS("-ERR\r\n");
+    return -1;
+  }
+
+  int baud = mrbc_atoi(token, 10);
+  if( baud <= 0 ) {
+    STRM_PUTS("-ERR Illegal baud rate.\r\n");
+    return -1;
+  }
+
+  uint32_t old_baud = STRM_GET_BAUD();
+  STRM_PUTS("+OK\r\n");
+  if( STRM_SET_BAUD( baud ) != 0 ) goto FALLBACK;
+
+  // check the test pattern.
+  t0 = HAL_GetTick();
+  while( !STRM_CAN_READ_LINE() ) {
+    if( HAL_GetTick() - t0 >= BAUD_TEST_TIMEOUT_MS ) goto FALLBACK;
+  }
+  if( STRM_GETS(buf, sizeof(buf)) < 0 ) goto FALLBACK;
+  if( strncmp( buf, BAUD_TEST_PATTERN, sizeof(BAUD_TEST_PATTERN)-1 ) != 0 ) {
+    goto FALLBACK;
+  }
+
+  STRM_PUTS("+OK " BAUD_TEST_PATTERN "\r\n");
+
+  // wait for the confirmation.
+  t0 = HAL_GetTick();
+  while( !STRM_CAN_READ_LINE() ) {
+    if( HAL_GetTick() - t0 >= BAUD_TEST_TIMEOUT_MS ) goto FALLBACK;
+  }
+  if( STRM_GETS(buf, sizeof(buf)) < 0 ) goto FALLBACK;
+  if( strncmp( buf, BAUD_CONFIRM "\r", sizeof(BAUD_CONFIRM) ) != 0 ) goto FALLBACK;
+
+  STRM_PUTS("+OK\r\n");
+  if( console_baud_ == 0 ) console_baud_ = old_baud;
+  return 0;
+
+ FALLBACK:
+  STRM_SET_BAUD( old_baud );
+  return -1;
+}
+
+
+//================================================================
+/*! command 'mrbw2'
+
+  Switch to the MRBW2 frame mode. (see receive_frame)
+
+  +OK MRBW2 (window) (max payload)
+    window is the number of bytes that the host may send ahead of
+    the responses. it is the size of the receive FIFO.
+*/
+static int cmd_mrbw2( void *buffer, int buffer_size )
+{
+  int max_payload = buffer_size - MRBW2_REPLY_SIZE - 4;
+  if( max_payload > 0xffff ) max_payload = 0xffff;
+  if( max_payload < MRBW2_MIN_PAYLOAD ) {
+    STRM_PUTS("-ERR Buffer too small.\r\n");
+    return -1;
+  }
+
+  char buf[40];
+  mrbc_snprintf(buf, sizeof(buf), "+OK MRBW2 %d %d\r\n", UART_SIZE_RXFIFO, max_payload);
+  STRM_PUTS(buf);
+  frame_mode_ = 1;
+
+  return 0;
+}
+
+
+//================================================================
+/*! execute a command line.
+
+  @param  line		command line. (modified by strtok)
+  @return int		return value of the command. (1: to execute VM)
+*/
+static int execute_command( char *line, void *buffer, int buffer_size )
+{
+  // split tokens.
+  char *token = strtok( line, WHITE_SPACE );
+  if( token == NULL ) {
+    STRM_PUTS("+OK mruby/c\r\n");
+    return 0;
+  }
+
+  // find command.
+  int i;
+  for( i = 0; i < NUM_TBL_COMMANDS; i++ ) {
+    if( strcmp( token, TBL_COMMANDS[i].command ) == 0 ) break;
+  }
+  if( i == NUM_TBL_COMMANDS ) {
+    STRM_PUTS("-ERR Illegal command. '");
+    STRM_PUTS(token);
+    STRM_PUTS("'\r\n");
+    return -1;
+  }
+  if( frame_mode_ && (TBL_COMMANDS[i].flags & CMD_TEXT_ONLY) ) {
+    STRM_PUTS("-ERR Not available in the frame mode.\r\n");
+    return -1;
+  }
+
+  // execute command.
+  return (TBL_COMMANDS[i].function)(buffer, buffer_size);
+}
+
+
+//================================================================
+/*! receive a request frame and execute it. (frame mode)
+
+  The payload of a request is a command line, followed by NUL and
+  binary data for 'data' command. The response has the same seq, and
+  its payload is the response of the command in the text mode as is.
+
+  The host may send the next requests without waiting for the
+  responses, up to the window. They wait in the receive FIFO, and
+  are executed in order.
+  CR LF alone, with a quiet time before and after it, returns to the
+  text mode. (sync probe) Other bytes out of a frame, such as the rest
+  of a frame with a broken header, are discarded up to the next SOH.
+
+  @return int		1 if 'execute' command.
+*/
+static int receive_frame( uint8_t *buffer, int buffer_size )
+{
+  int req_size = buffer_size - MRBW2_REPLY_SIZE;
+  uint8_t hdr[5] = {0};
+  uint8_t crc[4];
+  int escape = 0;	// 1: quiet, 2: quiet and CR, 3: quiet and CR LF.
+
+  // find a frame header.
+  while( 1 ) {
+    if( strm_read_timeout( hdr, 1, MRBW2_ESCAPE_GAP_MS ) < 0 ) {
+      if( escape == 3 ) {
+        frame_mode_ = 0;
+        STRM_PUTS("+OK mruby/c\r\n");
+        return 0;
+      }
+      escape = 1;
+      continue;
+    }
+    if( hdr[0] == MRBW2_SOH ) break;
+
+    if( escape == 1 && hdr[0] == '\r' ) {
+      escape = 2;
+    } else if( escape == 2 && hdr[0] == '\n' ) {
+      escape = 3;
+    } else {
+      escape = 0;
+    }
+  }
+  if( strm_read_timeout( hdr+1, 4, BWRITE_TIMEOUT_MS ) < 0 ) return 0;
+  if( (uint8_t)~(hdr[1] ^ hdr[2] ^ hdr[3]) != hdr[4] ) return 0;
+
+  int len = hdr[2] << 8 | hdr[3];
+  if( len > req_size - 4 ) return 0;	// room for NUL and padding.
+
+  // receive the payload and its CRC.
+  if( strm_read_timeout( buffer, len, BWRITE_TIMEOUT_MS ) < 0 ) return 0;
+  if( strm_read_timeout( crc, 4, BWRITE_TIMEOUT_MS ) < 0 ) return 0;
+
+  // execute, and collect the response.
+  int ret = 0;
+  frame_seq_ = hdr[1];
+  reply_buf_ = buffer + req_size;
+  reply_len_ = 0;
+
+  uint32_t c = crc[0] << 24 | crc[1] << 16 | crc[2] << 8 | crc[3];
+  if( c != calc_crc32( buffer, len ) ) {
+    if( write_.size != 0 ) {
+      char buf[20];
+      mrbc_snprintf(buf, sizeof(buf), "-NAK %d\r\n", write_.offset);
+      STRM_PUTS(buf);
+    } else {
+      STRM_PUTS("-ERR CRC error.\r\n");
+    }
+  } else {
+    uint8_t *nul = memchr( buffer, 0, len );
+    buffer[len] = 0;
+    frame_data_ = nul ? nul + 1 : buffer + len;
+    frame_data_len_ = len - (frame_data_ - buffer);
+    ret = execute_command( (char *)buffer, buffer, req_size );
+  }
+
+  send_reply();
+
+  return ret;
+}
+
+
+//================================================================
+/*! receive bytecode mode
+*/
+int receive_bytecode( void *buffer, int buffer_size )
+{
+  char buf[50];
+
+  frame_mode_ = 0;
+  STRM_PUTS("+OK mruby/c\r\n");
+
+  while( 1 ) {
+    if( frame_mode_ ) {
+      if( receive_frame( buffer, buffer_size ) == 1 ) break;
+      continue;
+    }
+
+    // get the command string.
+    if( STRM_GETS(buf, sizeof(buf)) < 0 ) {
+      STRM_RESET();
+      continue;
+    }
+
+    if( execute_command( buf, buffer, buffer_size ) == 1 ) break;
+  }
+
+  return 0;
+}
+
+
+//================================================================
+/*! pick up a task
+*/
+void * pickup_task( void *task )
+{
+  struct PROGRAM_ITER_T it = {0};
+  struct PROGRAM_T prog;
+  int found = (task == NULL);
+
+  while( next_program( &it, &prog )) {
+    if( found ) return (void *)prog.addr;
+    if( prog.addr == task ) found = 1;
   }
 
   return 0;
@@ -94,6 +94,36 @@ int uart_setmode( const UART_HANDLE *hndl, int baud, int parity, int stop_bits )
 }
 
 
+//================================================================
+/*! change the baud rate.
+
+  Waits for the transmission to complete, then restarts the DMA
+  reception at the new speed. Unread received data is discarded.
+
+  @memberof UART_HANDLE
+  @param  hndl		target UART_HANDLE
+  @param  baud		baud rate.
+  @return int		0 if no error.
+*/
+int uart_set_baudrate( UART_HANDLE *hndl, int baud )
+{
+  UART_HandleTypeDef *huart = hndl->hal_uart;
+
+  while( !__HAL_UART_GET_FLAG( huart, UART_FLAG_TC )) {
+    __NOP(); __NOP(); __NOP(); __NOP();
+  }
+
+  HAL_UART_AbortReceive( huart );
+  int ret = uart_setmode( hndl, baud, -1, -1 );
+  HAL_UART_Receive_DMA( huart, hndl->rxfifo, hndl->rxfifo_size );
+  hndl->rx_rd = 0;
+  hndl->rx_scan = 0;
+  hndl->rx_line_len = 0;
+
+  return ret;
+}
+
+
 //================================================================
 /*! Receive binary data.
 
@@ -131,6 +161,10 @@ int uart_read( UART_HANDLE *hndl, void *buffer, int size )
     }
   }
 
+  // the line scan may have been passed. start over.
+  hndl->rx_scan = hndl->rx_rd;
+  hndl->rx_line_len = 0;
+
   return size;
 }
 
@@ -183,6 +217,7 @@ int uart_gets( UART_HANDLE *hndl, void *buffer, int size )
     if( hndl->rx_rd >= hndl->rxfifo_size ) hndl->rx_rd = 0;
   }
   *buf = '\0';
+  hndl->rx_line_len = 0;	// rx_scan is at rx_rd now.
 
   return len;
 }
@@ -224,25 +259,35 @@ int uart_bytes_available( const UART_HANDLE *hndl )
 //================================================================
 /*! check data can be read a line.
 
+  Only the bytes received since the last call are scanned, and the
+  line found is kept until it is read by uart_gets().
+
   @memberof UART_HANDLE
   @param  hndl		target UART_HANDLE
   @return int		string length.
 */
-int uart_can_read_line( const UART_HANDLE *hndl )
+int uart_can_read_line( UART_HANDLE *hndl )
 {
-  uint16_t idx   = hndl->rx_rd;
+  if( hndl->rx_line_len ) return hndl->rx_line_len;
+
+  uint16_t idx   = hndl->rx_scan;
   uint16_t rx_wr = uart_get_wr_pos(hndl);
 
   while( idx != rx_wr ) {
-    if( hndl->rxfifo[idx++] == hndl->delimiter ) {
+    uint8_t ch = hndl->rxfifo[idx++];
+    if( idx >= hndl->rxfifo_size ) idx = 0;
+
+    if( ch == hndl->delimiter ) {
       if( hndl->rx_rd < idx ) {
-	return idx - hndl->rx_rd;
+	hndl->rx_line_len = idx - hndl->rx_rd;
       } else {
-	return hndl->rxfifo_size - hndl->rx_rd + idx;
+	hndl->rx_line_len = hndl->rxfifo_size - hndl->rx_rd + idx;
       }
+      hndl->rx_scan = idx;
+      return hndl->rx_line_len;
     }
-    if( idx >= hndl->rxfifo_size ) idx = 0;
   }
+  hndl->rx_scan = idx;
 
   return 0;
 }
@@ -257,4 +302,6 @@ int uart_can_read_line( const UART_HANDLE *hndl )
 void uart_clear_rx_buffer( UART_HANDLE *hndl )
 {
   hndl->rx_rd = uart_get_wr_pos( hndl );
+  hndl->rx_scan = hndl->rx_rd;
+  hndl->rx_line_len = 0;
 }
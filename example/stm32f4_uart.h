@@ -32,6 +32,8 @@ typedef struct UART_HANDLE {
   uint8_t unit_num;		//!< UART unit number 1..
   uint8_t delimiter;		//!< line delimiter such as '\\n'
   uint16_t rx_rd;		//!< index of rxfifo for read.
+  uint16_t rx_scan;		//!< index of rxfifo to scan for the delimiter next.
+  uint16_t rx_line_len;		//!< length of the line found by the scan. (0: not yet)
 
   UART_HandleTypeDef *hal_uart;		//!< STM32 HAL library UART handle.
   int rxfifo_size;			//!< FIFO size
@@ -51,12 +53,13 @@ extern UART_HANDLE * const TBL_UART_HANDLE[];
 */
 void uart_init(void);
 int uart_setmode(const UART_HANDLE *hndl, int baud, int parity, int stop_bits);
+int uart_set_baudrate(UART_HANDLE *hndl, int baud);
 int uart_read(UART_HANDLE *hndl, void *buffer, int size);
 int uart_write(UART_HANDLE *hndl, const void *buffer, int size);
 int uart_gets(UART_HANDLE *hndl, void *buffer, int size);
 int uart_is_readable(const UART_HANDLE *hndl);
 int uart_bytes_available(const UART_HANDLE *hndl);
-int uart_can_read_line(const UART_HANDLE *hndl);
+int uart_can_read_line(UART_HANDLE *hndl);
 void uart_clear_rx_buffer(UART_HANDLE *hndl);
 
 
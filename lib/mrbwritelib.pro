@@ -0,0 +1,17 @@
+######################################################################
+# mrbwrite library. (static)
+######################################################################
+
+TEMPLATE = lib
+TARGET = mrbwrite
+CONFIG += staticlib
+
+include(../mrbwritelib.pri)
+
+
+#add
+QT -= gui
+
+macx {
+    QMAKE_APPLE_DEVICE_ARCHS = x86_64 arm64
+}
@@ -0,0 +1,112 @@
+/*! @file
+  @brief
+  LZSS compressor for the compressed bytecode transfer.
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+
+  Format:
+  A flag byte is followed by up to 8 items. Bit n (LSB first) of the
+  flag byte tells the type of the n-th item.
+   1: literal.  one byte.
+   0: match.    two bytes. 12 bit distance-1 and 4 bit length-3.
+                b0 = (distance-1) & 0xff
+                b1 = ((distance-1) >> 8) << 4 | (length-3)
+  The decoder uses its own output as the window, so it needs no RAM
+  other than the output buffer.
+*/
+
+#include <stdint.h>
+#include <QVector>
+
+#include "lzss.h"
+
+static const int WINDOW_SIZE = 4096;
+static const int MIN_MATCH = 3;
+static const int MAX_MATCH = 18;
+static const int HASH_BITS = 12;
+static const int MAX_CHAIN = 64;
+
+
+//================================================================
+/*! hash of 3 bytes.
+*/
+static inline int lzss_hash( const uint8_t *p )
+{
+  return ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & ((1 << HASH_BITS) - 1);
+}
+
+
+//================================================================
+/*! compress
+
+  @param	src	source data.
+  @return	compressed data.
+*/
+QByteArray lzss_compress( const QByteArray &src )
+{
+  const uint8_t *p = (const uint8_t *)src.constData();
+  const int size = src.size();
+  QVector<int> head( 1 << HASH_BITS, -1 );
+  QVector<int> prev( size, -1 );
+  QByteArray dst;
+  int flag_pos = 0;
+  int n_items = 8;
+  int i = 0;
+
+  dst.reserve( size + size / 8 + 1 );
+
+  while( i < size ) {
+    if( n_items == 8 ) {
+      flag_pos = dst.size();
+      dst.append( '\0' );
+      n_items = 0;
+    }
+
+    // find the longest match in the window.
+    int best_len = 0;
+    int best_dist = 0;
+    if( i + MIN_MATCH <= size ) {
+      int max_len = qMin( MAX_MATCH, size - i );
+      int cand = head[ lzss_hash( p + i ) ];
+      for( int n = 0; cand >= 0 && i - cand <= WINDOW_SIZE && n < MAX_CHAIN; n++ ) {
+        int len = 0;
+        while( len < max_len && p[cand + len] == p[i + len] ) len++;
+        if( len > best_len ) {
+          best_len = len;
+          best_dist = i - cand;
+          if( len == max_len ) break;
+        }
+        cand = prev[cand];
+      }
+    }
+
+    int n_advance;
+    if( best_len >= MIN_MATCH ) {
+      int d = best_dist - 1;
+      dst.append( char(d & 0xff) );
+      dst.append( char(((d >> 8) << 4) | (best_len - MIN_MATCH)) );
+      n_advance = best_len;
+    } else {
+      dst[flag_pos] = char( uint8_t(dst[flag_pos]) | (1 << n_items) );
+      dst.append( char(p[i]) );
+      n_advance = 1;
+    }
+    n_items++;
+
+    // register the positions to the hash chain.
+    for( ; n_advance > 0; n_advance--, i++ ) {
+      if( i + MIN_MATCH > size ) continue;
+      int h = lzss_hash( p + i );
+      prev[i] = head[h];
+      head[h] = i;
+    }
+  }
+
+  return dst;
+}
@@ -0,0 +1,20 @@
+/*! @file
+  @brief
+  LZSS compressor for the compressed bytecode transfer.
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+#ifndef LZSS_H
+#define LZSS_H
+
+#include <QByteArray>
+
+QByteArray lzss_compress( const QByteArray &src );
+
+#endif
@@ -0,0 +1,259 @@
+/*! @file
+  @brief
+  mruby/c irep file writer. (daemon mode)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+
+#include <QCoreApplication>
+#include <QThread>
+#include <QJsonDocument>
+#include <QJsonArray>
+
+#include "mrbdaemon.h"
+#include "rite.h"
+
+
+//================================================================
+/*! constructor
+
+  @param	name	local server name.
+  @param	lines	device names to serve.
+  @param	opt	session options.
+  @param	parent	parent object.
+*/
+MrbDaemon::MrbDaemon( const QString &name, const QStringList &lines,
+                      const MrbSessionOption &opt, QObject *parent )
+  : QObject( parent ),
+    qout_(stdout),
+    name_(name)
+{
+  MrbSessionOption session_opt = opt;
+  session_opt.capture = true;
+
+  foreach( const QString &line, lines ) {
+    Port *port = new Port;
+    port->session = new MrbSession( line, session_opt );
+    if( lines.size() > 1 ) port->session->set_prefix( QString("[%1] ").arg(line) );
+    port->thread = new QThread( this );
+    port->session->moveToThread( port->thread );
+    connect( port->session, &MrbSession::job_finished, this, &MrbDaemon::job_finished );
+    port->thread->start();
+    ports_.append( port );
+  }
+
+  connect( &server_, &QLocalServer::newConnection, this, &MrbDaemon::new_connection );
+}
+
+
+//================================================================
+/*! destructor
+*/
+MrbDaemon::~MrbDaemon()
+{
+  foreach( Port *port, ports_ ) {
+    port->thread->quit();
+    port->thread->wait();
+    delete port->session;
+    delete port;
+  }
+}
+
+
+//================================================================
+/*! start listening.
+
+  @retval	bool	true: no error
+*/
+bool MrbDaemon::start()
+{
+  QLocalServer::removeServer( name_ );
+  if( !server_.listen( name_ )) {
+    qout_ << tr("Can't listen on '%1'. %2").arg(name_).arg(server_.errorString()) << Qt::endl;
+    return false;
+  }
+
+  qout_ << tr("Listening on '%1'.").arg(server_.fullServerName()) << Qt::endl;
+  return true;
+}
+
+
+//================================================================
+/*! a client has connected.
+*/
+void MrbDaemon::new_connection()
+{
+  while( QLocalSocket *socket = server_.nextPendingConnection() ) {
+    connect( socket, &QLocalSocket::readyRead, this, &MrbDaemon::read_request );
+    connect( socket, &QLocalSocket::disconnected, socket, &QObject::deleteLater );
+  }
+}
+
+
+//================================================================
+/*! read requests from a client.
+*/
+void MrbDaemon::read_request()
+{
+  QLocalSocket *socket = qobject_cast<QLocalSocket *>(sender());
+  if( !socket ) return;
+
+  while( socket->canReadLine() ) {
+    QJsonParseError error;
+    QJsonDocument doc = QJsonDocument::fromJson( socket->readLine(), &error );
+    if( !doc.isObject() ) {
+      RequestPtr req( new Request );
+      req->socket = socket;
+      req->flag_error = 1;
+      reply_done( req, tr("Illegal request. %1").arg(error.errorString()) );
+      continue;
+    }
+    handle_request( socket, doc.object() );
+  }
+}
+
+
+//================================================================
+/*! load the files of a request, and queue a job for each port.
+
+  @param	socket	client.
+  @param	req	request.
+*/
+void MrbDaemon::handle_request( QLocalSocket *socket, const QJsonObject &req )
+{
+  RequestPtr request( new Request );
+  request->socket = socket;
+
+  // load and validate all files.
+  MrbSessionJob job;
+  job.force = req["force"].toBool( false );
+  job.compress = req["compress"].toBool( false );
+  job.execute = req["execute"].toBool( true );
+  job.verify = req["verify"].toBool( false );
+  foreach( const QJsonValue &v, req["files"].toArray() ) {
+    MrbImage image;
+    RiteInfo rite;
+    QString error;
+    if( !image.load( v.toString() )) {
+      request->flag_error = 1;
+      reply_done( request, image.error_string() );
+      return;
+    }
+    if( !rite_parse( image.data(), &rite, &error )) {
+      request->flag_error = 1;
+      reply_done( request, tr("Invalid mrb file '%1'. %2").arg(v.toString()).arg(error) );
+      return;
+    }
+    job.images << image;
+  }
+
+  // select the ports. (all ports if not given)
+  QList<Port *> targets;
+  QJsonArray lines = req["lines"].toArray();
+  foreach( Port *port, ports_ ) {
+    if( lines.isEmpty() || lines.contains( port->session->line() )) targets << port;
+  }
+  foreach( const QJsonValue &v, lines ) {
+    bool found = false;
+    foreach( Port *port, ports_ ) {
+      if( port->session->line() == v.toString() ) found = true;
+    }
+    if( !found ) {
+      request->flag_error = 1;
+      reply_done( request, tr("Not served by this daemon '%1'.").arg(v.toString()) );
+      return;
+    }
+  }
+
+  qout_ << tr("Job: %1 file(s) to %2 port(s).").arg(job.images.size()).arg(targets.size()) << Qt::endl;
+  request->n_pending = targets.size();
+  foreach( Port *port, targets ) {
+    port->queue.enqueue( qMakePair( request, job ));
+    dispatch( port );
+  }
+}
+
+
+//================================================================
+/*! start the next job of a port, if it is idle.
+*/
+void MrbDaemon::dispatch( Port *port )
+{
+  if( port->current || port->queue.isEmpty() ) return;
+
+  QPair<RequestPtr, MrbSessionJob> next = port->queue.dequeue();
+  port->current = next.first;
+
+  MrbSession *session = port->session;
+  MrbSessionJob job = next.second;
+  QMetaObject::invokeMethod( session, [session, job]() {
+    session->run_job( job );
+  }, Qt::QueuedConnection );
+}
+
+
+//================================================================
+/*! a job has finished.
+*/
+void MrbDaemon::job_finished()
+{
+  MrbSession *session = qobject_cast<MrbSession *>(sender());
+  Port *port = 0;
+  foreach( Port *p, ports_ ) {
+    if( p->session == session ) port = p;
+  }
+  if( !port || !port->current ) return;
+
+  RequestPtr req = port->current;
+  port->current.reset();
+
+  qout_ << QString("%1 %2 %3 ms").arg( session->line(), -16 )
+    .arg( QString( session->result() == 0 ? "OK" : "ERROR" ), -6 )
+    .arg( session->elapsed_ms(), 6 ) << Qt::endl;
+
+  QJsonObject obj;
+  obj["line"] = session->line();
+  obj["result"] = session->result();
+  obj["elapsed_ms"] = session->elapsed_ms();
+  obj["log"] = session->take_log();
+  reply( req->socket, obj );
+
+  if( session->result() != 0 ) req->flag_error = 1;
+  if( --req->n_pending == 0 ) reply_done( req );
+
+  dispatch( port );
+}
+
+
+//================================================================
+/*! send a reply line to a client.
+*/
+void MrbDaemon::reply( QLocalSocket *socket, const QJsonObject &obj )
+{
+  if( !socket ) return;		// the client has gone.
+
+  socket->write( QJsonDocument( obj ).toJson( QJsonDocument::Compact ) + "\n" );
+  socket->flush();
+}
+
+
+//================================================================
+/*! send the last reply line of a request.
+*/
+void MrbDaemon::reply_done( const RequestPtr &req, const QString &error )
+{
+  QJsonObject obj;
+  obj["done"] = true;
+  obj["result"] = req->flag_error;
+  if( !error.isEmpty() ) {
+    obj["error"] = error;
+    qout_ << error << Qt::endl;
+  }
+  reply( req->socket, obj );
+}
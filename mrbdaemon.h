@@ -0,0 +1,89 @@
+/*! @file
+  @brief
+  mruby/c irep file writer. (daemon mode)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+#ifndef MRBDAEMON_H
+#define MRBDAEMON_H
+
+#include <QObject>
+#include <QStringList>
+#include <QTextStream>
+#include <QSharedPointer>
+#include <QPointer>
+#include <QQueue>
+#include <QPair>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QJsonObject>
+
+#include "mrbsession.h"
+
+class QThread;
+
+
+//================================================================
+/*! MrbDaemon class.
+
+  Keeps one session per port open, and runs the jobs requested over
+  a local socket. A request is one line of JSON.
+
+    {"lines":["COM3"], "files":["/path/PROG1.mrb"],
+     "force":false, "compress":false, "execute":true, "verify":false}
+
+  The reply is one line per port, and a last line with "done".
+
+    {"line":"COM3", "result":0, "elapsed_ms":120, "log":"..."}
+    {"done":true, "result":0}
+*/
+class MrbDaemon : public QObject
+{
+  Q_OBJECT
+
+public:
+  MrbDaemon( const QString &name, const QStringList &lines,
+             const MrbSessionOption &opt, QObject *parent = 0 );
+  ~MrbDaemon();
+  bool start();
+
+private slots:
+  void new_connection();
+  void read_request();
+  void job_finished();
+
+private:
+  //! one request from a client.
+  struct Request {
+    QPointer<QLocalSocket> socket;	//!< client. (null if gone)
+    int n_pending = 0;			//!< jobs not finished.
+    int flag_error = 0;
+  };
+  typedef QSharedPointer<Request> RequestPtr;
+
+  //! one port and its queued jobs.
+  struct Port {
+    MrbSession *session = 0;
+    QThread *thread = 0;
+    RequestPtr current;			//!< request of the running job.
+    QQueue<QPair<RequestPtr, MrbSessionJob>> queue;
+  };
+
+  QTextStream qout_;		//!< console output stream.
+  QString name_;		//!< server name.
+  QLocalServer server_;		//!< local socket server.
+  QList<Port *> ports_;		//!< ports, in the order of -l option.
+
+  void handle_request( QLocalSocket *socket, const QJsonObject &req );
+  void dispatch( Port *port );
+  void reply( QLocalSocket *socket, const QJsonObject &obj );
+  void reply_done( const RequestPtr &req, const QString &error = QString() );
+};
+
+#endif
@@ -0,0 +1,218 @@
+/*! @file
+  @brief
+  mruby/c irep file writer. (target port detector)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+
+#include <QEventLoop>
+
+#include "mrbdetector.h"
+
+static const int PROBE_INTERVAL_MS = 50;
+static const int DETECT_TIMEOUT_MS = 500;
+
+
+//================================================================
+/*! is the port the USB device of the filter?
+
+  @param	info	port.
+  @retval	bool	true: matched.
+*/
+bool MrbPortFilter::match( const QSerialPortInfo &info ) const
+{
+  if( vid >= 0 && (!info.hasVendorIdentifier() || info.vendorIdentifier() != vid) ) return false;
+  if( pid >= 0 && (!info.hasProductIdentifier() || info.productIdentifier() != pid) ) return false;
+  if( !serial.isEmpty() && info.serialNumber() != serial ) return false;
+
+  return true;
+}
+
+
+//================================================================
+/*! constructor
+
+  @param	parent	parent object.
+*/
+MrbDetector::MrbDetector( QObject *parent )
+  : QObject( parent ),
+    baud_rate_(57600),
+    timeout_ms_(DETECT_TIMEOUT_MS)
+{
+  timer_.setInterval( PROBE_INTERVAL_MS );
+  connect( &timer_, &QTimer::timeout, this, &MrbDetector::tick );
+}
+
+
+//================================================================
+/*! destructor
+*/
+MrbDetector::~MrbDetector()
+{
+  foreach( const Probe &probe, probes_ ) {
+    delete probe.port;
+  }
+}
+
+
+//================================================================
+/*! start probing ports. returns at once.
+
+  A port that is already being probed is skipped.
+
+  @param	ports	ports to probe.
+*/
+void MrbDetector::start( const QList<QSerialPortInfo> &ports )
+{
+  foreach( const QSerialPortInfo &info, ports ) {
+    bool probing = false;
+    foreach( const Probe &p, probes_ ) {
+      if( p.info.systemLocation() == info.systemLocation() ) probing = true;
+    }
+    if( probing ) continue;
+
+    Probe probe;
+    probe.info = info;
+    probe.port = new QSerialPort( info, this );
+    probe.deadline = QDeadlineTimer( timeout_ms_ );
+    if( !probe.port->open( QIODevice::ReadWrite ) ||
+        !probe.port->setBaudRate( baud_rate_ )) {
+      delete probe.port;
+      emit not_found( info );
+      continue;
+    }
+    probe.port->setDataBits( QSerialPort::Data8 );
+    probe.port->setParity( QSerialPort::NoParity );
+    probe.port->setStopBits( QSerialPort::OneStop );
+    probe.port->setFlowControl( QSerialPort::HardwareControl );
+    probe.port->clear();
+    probe.port->write("\r\n");
+    connect( probe.port, &QSerialPort::readyRead, this, &MrbDetector::read_reply );
+    probes_.append( probe );
+  }
+
+  if( probes_.isEmpty() ) {
+    emit finished();
+    return;
+  }
+  if( !timer_.isActive() ) timer_.start();
+}
+
+
+//================================================================
+/*! probe ports, and wait for the result.
+
+  @param	ports	ports to probe.
+  @return	ports that a target answered, in the order of ports.
+*/
+QList<QSerialPortInfo> MrbDetector::detect( const QList<QSerialPortInfo> &ports )
+{
+  QStringList answered;
+  QEventLoop loop;
+  auto conn = connect( this, &MrbDetector::found, &loop,
+                       [&answered]( const QSerialPortInfo &info ) {
+                         answered << info.systemLocation();
+                       });
+  connect( this, &MrbDetector::finished, &loop, &QEventLoop::quit );
+  start( ports );
+  if( is_running() ) loop.exec();
+  disconnect( conn );
+
+  QList<QSerialPortInfo> ret;
+  foreach( const QSerialPortInfo &info, ports ) {
+    if( answered.contains( info.systemLocation() )) ret << info;
+  }
+  return ret;
+}
+
+
+//================================================================
+/*! candidate ports.
+
+  @param	filter	USB device filter.
+  @return	available ports that match the filter.
+*/
+QList<QSerialPortInfo> MrbDetector::candidates( const MrbPortFilter &filter )
+{
+  QList<QSerialPortInfo> ret;
+
+  foreach( const QSerialPortInfo &info, QSerialPortInfo::availablePorts() ) {
+    if( filter.match( info )) ret << info;
+  }
+  return ret;
+}
+
+
+//================================================================
+/*! send the next probe, and give up the silent ports.
+*/
+void MrbDetector::tick()
+{
+  for( int i = probes_.size() - 1; i >= 0; i-- ) {
+    Probe &probe = probes_[i];
+    if( probe.deadline.hasExpired() ||
+        probe.port->error() != QSerialPort::NoError ) {
+      finish( i, false );
+      continue;
+    }
+    probe.port->write("\r\n");
+  }
+}
+
+
+//================================================================
+/*! read the replies to the probes.
+*/
+void MrbDetector::read_reply()
+{
+  QSerialPort *port = qobject_cast<QSerialPort *>(sender());
+  int idx = 0;
+  while( idx < probes_.size() && probes_[idx].port != port ) idx++;
+  if( idx == probes_.size() ) return;
+
+  Probe &probe = probes_[idx];
+  probe.rx.append( port->readAll() );
+  int n;
+  while( (n = probe.rx.indexOf('\n')) >= 0 ) {
+    QByteArray r = probe.rx.left( n + 1 );
+    probe.rx.remove( 0, n + 1 );
+    if( r.startsWith("+OK mruby/c") ) {
+      finish( idx, true );
+      return;
+    }
+  }
+  if( probe.rx.size() > 256 ) probe.rx.clear();	// not a target.
+}
+
+
+//================================================================
+/*! stop probing a port.
+
+  The port is closed, so that a session can open it.
+
+  @param	idx		index of probes_.
+  @param	is_found	true: a target answered.
+*/
+void MrbDetector::finish( int idx, bool is_found )
+{
+  Probe probe = probes_.takeAt( idx );
+  probe.port->close();
+  probe.port->deleteLater();
+
+  if( is_found ) {
+    emit found( probe.info );
+  } else {
+    emit not_found( probe.info );
+  }
+
+  if( probes_.isEmpty() ) {
+    timer_.stop();
+    emit finished();
+  }
+}
@@ -0,0 +1,92 @@
+/*! @file
+  @brief
+  mruby/c irep file writer. (target port detector)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+#ifndef MRBDETECTOR_H
+#define MRBDETECTOR_H
+
+#include <QObject>
+#include <QList>
+#include <QStringList>
+#include <QTimer>
+#include <QDeadlineTimer>
+#include <QSerialPort>
+#include <QSerialPortInfo>
+
+
+//================================================================
+/*! USB device filter of the candidate ports.
+*/
+struct MrbPortFilter {
+  int vid = -1;			//!< USB vendor ID. (-1: any)
+  int pid = -1;			//!< USB product ID. (-1: any)
+  QString serial;		//!< USB serial number. (empty: any)
+
+  bool is_empty() const { return vid < 0 && pid < 0 && serial.isEmpty(); }
+  bool match( const QSerialPortInfo &info ) const;
+};
+
+
+//================================================================
+/*! MrbDetector class.
+
+  Finds the ports that a target is connected to. All candidate ports
+  are opened at once and probed with CRLF, the same as the connection
+  start of a session, and a port is found when "+OK mruby/c" comes
+  back. A port that does not answer in the timeout is given up.
+
+  Runs in the event loop of the caller's thread. found() or
+  not_found() is emitted for each port, and finished() when no port
+  is being probed.
+*/
+class MrbDetector : public QObject
+{
+  Q_OBJECT
+
+public:
+  explicit MrbDetector( QObject *parent = 0 );
+  ~MrbDetector();
+
+  void set_baud_rate( int baud_rate ) { baud_rate_ = baud_rate; }
+  void set_timeout( int timeout_ms ) { timeout_ms_ = timeout_ms; }
+  void start( const QList<QSerialPortInfo> &ports );
+  bool is_running() const { return !probes_.isEmpty(); }
+  QList<QSerialPortInfo> detect( const QList<QSerialPortInfo> &ports );
+
+  static QList<QSerialPortInfo> candidates( const MrbPortFilter &filter = MrbPortFilter() );
+
+signals:
+  void found( const QSerialPortInfo &info );
+  void not_found( const QSerialPortInfo &info );
+  void finished();
+
+private slots:
+  void tick();
+  void read_reply();
+
+private:
+  //! a port being probed.
+  struct Probe {
+    QSerialPortInfo info;
+    QSerialPort *port = 0;
+    QDeadlineTimer deadline;	//!< give up at.
+    QByteArray rx;		//!< received, not yet a line.
+  };
+
+  int baud_rate_;		//!< serial baud rate.
+  int timeout_ms_;		//!< give up a port after this.
+  QTimer timer_;		//!< probe interval.
+  QList<Probe> probes_;		//!< ports being probed.
+
+  void finish( int idx, bool is_found );
+};
+
+#endif
@@ -0,0 +1,55 @@
+/*! @file
+  @brief
+  .mrb file image. (memory mapped)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+
+#include <QCoreApplication>
+
+#include "mrbimage.h"
+
+
+//================================================================
+/*! load a .mrb file.
+
+  Maps the file into memory. If the file can't be mapped
+  (e.g. a pipe), reads it into one buffer instead.
+
+  @param	filename	file name.
+  @retval	bool		true: no error
+*/
+bool MrbImage::load( const QString &filename )
+{
+  filename_ = filename;
+  data_.clear();
+  file_.reset( new QFile( filename ));
+
+  if( !file_->open( QIODevice::ReadOnly )) {
+    error_string_ = QCoreApplication::translate("MrbImage", "Can't open file '%1'.").arg(filename);
+    file_.reset();
+    return false;
+  }
+
+  qint64 size = file_->size();
+  uchar *p = (size > 0) ? file_->map( 0, size ) : 0;
+  if( p ) {
+    data_ = QByteArray::fromRawData( (const char *)p, size );
+  } else {
+    data_ = file_->readAll();
+    file_.reset();
+  }
+
+  if( data_.isEmpty() ) {
+    error_string_ = QCoreApplication::translate("MrbImage", "Empty file '%1'.").arg(filename);
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,47 @@
+/*! @file
+  @brief
+  .mrb file image. (memory mapped)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+#ifndef MRBIMAGE_H
+#define MRBIMAGE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QSharedPointer>
+#include <QFile>
+
+
+//================================================================
+/*! MrbImage class.
+
+  Holds the contents of one .mrb file. The file is memory mapped if
+  possible, and data() refers to the mapping without a copy.
+  Copies of an MrbImage share the mapping, so one image can be
+  handed to several sessions.
+*/
+class MrbImage
+{
+public:
+  bool load( const QString &filename );
+
+  const QString &filename() const { return filename_; }
+  const QByteArray &data() const { return data_; }
+  qint64 size() const { return data_.size(); }
+  const QString &error_string() const { return error_string_; }
+
+private:
+  QString filename_;		//!< file name.
+  QSharedPointer<QFile> file_;	//!< keeps the mapping alive.
+  QByteArray data_;		//!< file contents. (raw data on the mapping)
+  QString error_string_;	//!< reason of the load error.
+};
+
+#endif
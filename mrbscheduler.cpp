@@ -0,0 +1,336 @@
+/*! @file
+  @brief
+  mruby/c irep file writer. (manifest scheduler)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+
+#include <QTimer>
+#include <QDir>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonArray>
+
+#include "mrbscheduler.h"
+#include "rite.h"
+
+#define VERBOSE(s) if( opt_.verbose ) { qout_ << s << Qt::endl; }
+
+
+//================================================================
+/*! constructor
+
+  @param	opt	session options given on the command line.
+  @param	parent	parent object.
+*/
+MrbScheduler::MrbScheduler( const MrbSessionOption &opt, QObject *parent )
+  : QObject( parent ),
+    qout_(stdout),
+    opt_(opt),
+    concurrency_(0),
+    retry_count_(0),
+    backoff_ms_(1000),
+    backoff_max_ms_(30000),
+    n_waiting_(0)
+{
+  connect( &writer_, &MrbWriter::finished, this, &MrbScheduler::board_finished );
+}
+
+
+//================================================================
+/*! load and validate the manifest and all .mrb files in it.
+
+  Relative paths in the manifest are relative to the manifest file.
+
+  @param	filename	manifest filename.
+  @retval	bool		true: no error
+*/
+bool MrbScheduler::load( const QString &filename )
+{
+  QFile file( filename );
+  if( !file.open( QIODevice::ReadOnly )) {
+    qout_ << tr("Can't open the manifest '%1'. %2").arg(filename).arg(file.errorString()) << Qt::endl;
+    return false;
+  }
+
+  QJsonParseError error;
+  QJsonDocument doc = QJsonDocument::fromJson( file.readAll(), &error );
+  if( !doc.isObject() ) {
+    qout_ << tr("Invalid manifest '%1'. %2").arg(filename).arg(error.errorString()) << Qt::endl;
+    return false;
+  }
+  QJsonObject root = doc.object();
+  QDir dir = QFileInfo( filename ).absoluteDir();
+
+  concurrency_ = root["concurrency"].toInt( 0 );
+  rite_version_ = root["rite_version"].toString();
+  QJsonObject retry = root["retry"].toObject();
+  retry_count_ = retry["count"].toInt( 0 );
+  backoff_ms_ = retry["backoff_ms"].toInt( 1000 );
+  backoff_max_ms_ = retry["backoff_max_ms"].toInt( 30000 );
+  if( root.contains("result_log") ) {
+    result_log_ = dir.filePath( root["result_log"].toString() );
+  }
+
+  MrbSessionOption defaults = board_option( opt_, root );
+  QJsonArray default_files = root["files"].toArray();
+
+  QJsonArray boards = root["boards"].toArray();
+  if( boards.isEmpty() ) {
+    qout_ << tr("No boards in the manifest '%1'.").arg(filename) << Qt::endl;
+    return false;
+  }
+
+  for( int i = 0; i < boards.size(); i++ ) {
+    QJsonObject obj = boards[i].toObject();
+    Board board;
+    board.line = obj["line"].toString();
+    board.name = obj["name"].toString( board.line );
+    if( board.line.isEmpty() ) {
+      qout_ << tr("boards[%1]: no line.").arg(i) << Qt::endl;
+      return false;
+    }
+    foreach( const Board &b, boards_ ) {
+      if( b.line == board.line ) {
+        qout_ << tr("boards[%1]: line '%2' is listed twice.").arg(i).arg(board.line) << Qt::endl;
+        return false;
+      }
+    }
+
+    board.opt = board_option( defaults, obj );
+    board.opt.capture = true;
+    board.opt.images.clear();
+    QJsonArray files = obj.contains("files") ? obj["files"].toArray() : default_files;
+    if( files.isEmpty() ) {
+      qout_ << tr("boards[%1]: no .mrb files.").arg(i) << Qt::endl;
+      return false;
+    }
+    foreach( const QJsonValue &v, files ) {
+      MrbImage image;
+      if( !load_image( dir.filePath( v.toString() ), &image )) return false;
+      board.opt.images << image;
+    }
+
+    boards_.append( board );
+  }
+
+  VERBOSE( tr("Manifest '%1': %2 boards, %3 files.")
+           .arg(filename).arg(boards_.size()).arg(images_.size()) );
+  return true;
+}
+
+
+//================================================================
+/*! session options of a board.
+
+  @param	base	default options.
+  @param	obj	manifest object. (the top level or a board)
+  @return	options overridden by the manifest.
+*/
+MrbSessionOption MrbScheduler::board_option( const MrbSessionOption &base, const QJsonObject &obj )
+{
+  MrbSessionOption opt = base;
+  opt.baud_rate = obj["speed"].toInt( base.baud_rate );
+  opt.switch_baud_rate = obj["switch_speed"].toInt( base.switch_baud_rate );
+  opt.timeout = obj["timeout"].toInt( base.timeout );
+  opt.compress = obj["compress"].toBool( base.compress );
+  opt.force = obj["force"].toBool( base.force );
+  opt.execute = obj["execute"].toBool( base.execute );
+  opt.verify = obj["verify"].toBool( base.verify );
+  opt.mrbw2 = obj["mrbw2"].toBool( base.mrbw2 );
+
+  return opt;
+}
+
+
+//================================================================
+/*! load and validate a .mrb file. (each file is loaded once)
+
+  @param	filename	.mrb filename.
+  @param	image		loaded image.
+  @retval	bool		true: no error
+*/
+bool MrbScheduler::load_image( const QString &filename, MrbImage *image )
+{
+  if( images_.contains( filename )) {
+    *image = images_.value( filename );
+    return true;
+  }
+
+  RiteInfo rite;
+  QString error;
+  if( !image->load( filename )) {
+    qout_ << image->error_string() << Qt::endl;
+    return false;
+  }
+  if( !rite_parse( image->data(), &rite, &error )) {
+    qout_ << tr("Invalid mrb file '%1'. %2").arg(filename).arg(error) << Qt::endl;
+    return false;
+  }
+  if( !rite_version_.isEmpty() && !QString(rite.version).endsWith( rite_version_ )) {
+    qout_ << tr("RITE version mismatch '%1'. %2 (expected %3)")
+      .arg(filename).arg(QString(rite.version)).arg(rite_version_) << Qt::endl;
+    return false;
+  }
+
+  images_.insert( filename, *image );
+  return true;
+}
+
+
+//================================================================
+/*! start writing all boards.
+
+  @retval	bool	true: no error
+*/
+bool MrbScheduler::start()
+{
+  if( !result_log_.isEmpty() ) {
+    result_log_file_.setFileName( result_log_ );
+    if( !result_log_file_.open( QIODevice::WriteOnly | QIODevice::Append )) {
+      qout_ << tr("Can't write '%1'.").arg(result_log_) << Qt::endl;
+      return false;
+    }
+  }
+
+  for( int i = 0; i < boards_.size(); i++ ) {
+    queue_.enqueue( i );
+  }
+  timer_.start();
+  schedule();
+
+  return true;
+}
+
+
+//================================================================
+/*! start the waiting boards, up to the concurrency limit.
+*/
+void MrbScheduler::schedule()
+{
+  int limit = (concurrency_ > 0) ? concurrency_ : boards_.size();
+
+  while( running_.size() < limit && !queue_.isEmpty() ) {
+    start_board( queue_.dequeue() );
+  }
+
+  if( running_.isEmpty() && queue_.isEmpty() && n_waiting_ == 0 ) {
+    show_summary();
+
+    int flag_error = 0;
+    foreach( const Board &board, boards_ ) {
+      if( board.result != 0 ) flag_error = 1;
+    }
+    emit finished( flag_error );
+  }
+}
+
+
+//================================================================
+/*! start a session for a board.
+
+  @param	idx	index of boards_.
+*/
+void MrbScheduler::start_board( int idx )
+{
+  Board &board = boards_[idx];
+  board.attempt++;
+  VERBOSE( tr("%1: start, attempt %2/%3.").arg(board.name).arg(board.attempt).arg(retry_count_ + 1) );
+
+  QString prefix = (boards_.size() > 1) ? QString("[%1] ").arg(board.name) : QString();
+  running_.insert( writer_.start( board.line, board.opt, prefix ), idx );
+}
+
+
+//================================================================
+/*! a session has finished.
+
+  @param	id	job id.
+  @param	r	result of the session.
+*/
+void MrbScheduler::board_finished( int id, const MrbWriterResult &r )
+{
+  if( !running_.contains( id )) return;
+
+  int idx = running_.take( id );
+  Board &board = boards_[idx];
+  board.result = r.result;
+  board.elapsed_ms += r.elapsed_ms;
+
+  qout_ << r.log;
+  write_result_log( board, r );
+
+  // retry with exponential backoff. the slot is free while waiting.
+  if( board.result != 0 && board.attempt <= retry_count_ ) {
+    qint64 delay = qMin<qint64>( (qint64)backoff_ms_ << qMin( board.attempt - 1, 20 ),
+                                 backoff_max_ms_ );
+    qout_ << tr("%1: failed, retry in %2 ms. (attempt %3/%4)")
+      .arg(board.name).arg(delay).arg(board.attempt + 1).arg(retry_count_ + 1) << Qt::endl;
+
+    n_waiting_++;
+    QTimer::singleShot( delay, this, [this, idx]() {
+      n_waiting_--;
+      queue_.enqueue( idx );
+      schedule();
+    });
+  }
+
+  schedule();
+}
+
+
+//================================================================
+/*! append the result of an attempt to the result log. (JSON lines)
+*/
+void MrbScheduler::write_result_log( const Board &board, const MrbWriterResult &r )
+{
+  if( !result_log_file_.isOpen() ) return;
+
+  QJsonArray files;
+  foreach( const MrbImage &image, board.opt.images ) {
+    files.append( image.filename() );
+  }
+
+  QJsonObject obj;
+  obj["date"] = QDateTime::currentDateTime().toString( Qt::ISODate );
+  obj["board"] = board.name;
+  obj["line"] = board.line;
+  obj["attempt"] = board.attempt;
+  obj["result"] = r.result;
+  obj["elapsed_ms"] = r.elapsed_ms;
+  obj["files"] = files;
+  obj["bytes_sent"] = r.stats.bytes_sent;
+  obj["log"] = r.log;
+
+  result_log_file_.write( QJsonDocument( obj ).toJson( QJsonDocument::Compact ) + "\n" );
+  result_log_file_.flush();
+}
+
+
+//================================================================
+/*! show per-board result summary.
+*/
+void MrbScheduler::show_summary()
+{
+  int n_ok = 0;
+
+  qout_ << Qt::endl << tr("Summary:") << Qt::endl;
+  foreach( const Board &board, boards_ ) {
+    if( board.result == 0 ) n_ok++;
+    qout_ << QString("  %1 %2 %3 %4 ms, %5 attempt(s)")
+      .arg( board.name, -16 )
+      .arg( board.line, -16 )
+      .arg( QString( board.result == 0 ? "OK" : "ERROR" ), -6 )
+      .arg( board.elapsed_ms, 6 )
+      .arg( board.attempt ) << Qt::endl;
+  }
+  qout_ << tr("  %1 OK, %2 failed, %3 ms.")
+    .arg(n_ok).arg(boards_.size() - n_ok).arg(timer_.elapsed()) << Qt::endl;
+}
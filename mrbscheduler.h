@@ -0,0 +1,99 @@
+/*! @file
+  @brief
+  mruby/c irep file writer. (manifest scheduler)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+#ifndef MRBSCHEDULER_H
+#define MRBSCHEDULER_H
+
+#include <QObject>
+#include <QStringList>
+#include <QTextStream>
+#include <QList>
+#include <QHash>
+#include <QQueue>
+#include <QFile>
+#include <QElapsedTimer>
+#include <QJsonObject>
+
+#include "mrbsession.h"
+#include "mrbwriter.h"
+
+
+//================================================================
+/*! MrbScheduler class.
+
+  Writes the boards listed in a manifest file, with a limited number
+  of sessions at a time, and retries the failed boards with backoff.
+
+    {
+      "concurrency": 4,
+      "rite_version": "0300",
+      "retry": { "count": 2, "backoff_ms": 1000, "backoff_max_ms": 30000 },
+      "result_log": "result.jsonl",
+      "files": [ "main.mrb" ],
+      "boards": [
+        { "line": "ttyUSB0", "name": "board-1" },
+        { "line": "ttyUSB1", "files": [ "sub.mrb", "main.mrb" ], "speed": 115200 }
+      ]
+    }
+*/
+class MrbScheduler : public QObject
+{
+  Q_OBJECT
+
+public:
+  MrbScheduler( const MrbSessionOption &opt, QObject *parent = 0 );
+  bool load( const QString &filename );
+  bool start();
+
+signals:
+  void finished( int result );
+
+private slots:
+  void board_finished( int id, const MrbWriterResult &r );
+
+private:
+  //! one board in the manifest.
+  struct Board {
+    QString name;		//!< board name. (default: line)
+    QString line;		//!< device name.
+    MrbSessionOption opt;	//!< session options and images.
+    int attempt = 0;		//!< number of attempts so far.
+    int result = -1;		//!< result of the last attempt. 0: no error
+    qint64 elapsed_ms = 0;	//!< total time of all attempts.
+  };
+
+  QTextStream qout_;		//!< console output stream.
+  MrbSessionOption opt_;	//!< options given on the command line.
+  int concurrency_;		//!< max sessions at a time. (0: no limit)
+  QString rite_version_;	//!< expected RITE version of all files.
+  int retry_count_;		//!< retries after the first attempt.
+  int backoff_ms_;		//!< wait before the first retry.
+  int backoff_max_ms_;		//!< longest wait between retries.
+  QString result_log_;		//!< result log filename. (JSON lines)
+  QFile result_log_file_;	//!< result log file.
+  QList<Board> boards_;		//!< boards, in the order of the manifest.
+  QHash<QString, MrbImage> images_; //!< loaded .mrb files, by path.
+  QQueue<int> queue_;		//!< boards waiting for a session.
+  MrbWriter writer_;		//!< runs the sessions.
+  QHash<int, int> running_;	//!< index of boards_, by job id.
+  int n_waiting_;		//!< boards in retry backoff.
+  QElapsedTimer timer_;		//!< time since start().
+
+  MrbSessionOption board_option( const MrbSessionOption &base, const QJsonObject &obj );
+  bool load_image( const QString &filename, MrbImage *image );
+  void schedule();
+  void start_board( int idx );
+  void write_result_log( const Board &board, const MrbWriterResult &r );
+  void show_summary();
+};
+
+#endif
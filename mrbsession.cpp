@@ -0,0 +1,1771 @@
+/*! @file
+  @brief
+  mruby/c irep file writer. (one target session)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+
+#define PROTOCOL_VERSION "MRBW1.2"
+
+#include <QCoreApplication>
+#include <QTextStream>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QDeadlineTimer>
+#include <QEventLoop>
+#include <QSerialPort>
+#include <QVector>
+#include <QPair>
+
+#include "mrbsession.h"
+#include "lzss.h"
+#include "crc32.h"
+
+#define VERBOSE(s) if( opt_verbose_ ) { out() << s << Qt::endl; }
+
+static const char * const STR_CANCEL = "\x018";
+static const char * const BAUD_TEST_PATTERN = "UUUUUUUU0123456789abcdefABCDEF";
+static const char * const BAUD_CONFIRM = "OK";
+static const int BAUD_TEST_TIMEOUT_MS = 300;	//!< wait for the test pattern echo.
+static const int TARGET_BAUD_TIMEOUT_MS = 1000;	//!< target's wait for the pattern and confirmation.
+static const int BWRITE_MIN_BLOCK_SIZE = 512;
+static const int BWRITE_MAX_BLOCKS = 256;
+static const int BWRITE_MAX_RETRY = 5;
+static const int BWRITE_TARGET_TIMEOUT_MS = 2000;	//!< target's receive timeout of 'bwrite'.
+static const char MRBW2_SOH = 0x01;
+static const int MRBW2_OVERHEAD = 9;		//!< frame header and CRC.
+static const int MRBW2_MAX_DATA = 1024;		//!< data size of a 'data' frame.
+static const int MRBW2_MAX_READ = 1024;		//!< size of a 'read' in the frame mode.
+static const int MRBW2_MAX_REPLY = 2048;	//!< response buffer of the target.
+
+
+//================================================================
+/*! constructor
+
+  @param	line	device name.
+  @param	opt	session options.
+*/
+MrbSession::MrbSession( const QString &line, const MrbSessionOption &opt )
+  : qout_(stdout),
+    opt_verbose_(opt.verbose),
+    opt_timeout_(opt.timeout),
+    opt_compress_(opt.compress),
+    opt_force_(opt.force),
+    opt_quiet_(opt.quiet),
+    opt_execute_(opt.execute),
+    opt_verify_(opt.verify),
+    opt_mrbw2_(opt.mrbw2),
+    line_(line),
+    images_(opt.images),
+    serial_port_(this),
+    serial_baud_rate_(opt.baud_rate),
+    switch_baud_rate_(opt.switch_baud_rate),
+    target_verified_(false),
+    frame_mode_(false),
+    frame_window_(0),
+    frame_max_payload_(0),
+    frame_seq_(0),
+    result_(-1),
+    elapsed_ms_(0)
+{
+  if( opt_quiet_ || opt.capture ) qout_.setString( &log_ );
+}
+
+
+//================================================================
+/*! take the captured output. (capture option)
+
+  @return	output since the last call.
+*/
+QString MrbSession::take_log()
+{
+  qout_.flush();
+  QString ret = log_;
+  log_.clear();
+  return ret;
+}
+
+
+//================================================================
+/*! set the prefix printed at the head of each output line.
+
+  @param	prefix	prefix string. (e.g. device name)
+*/
+void MrbSession::set_prefix( const QString &prefix )
+{
+  prefix_ = prefix;
+}
+
+
+//================================================================
+/*! session main function
+
+  connect target, clear, write all files and execute.
+  emit finished() signal at the end.
+*/
+void MrbSession::run()
+{
+  QElapsedTimer timer;
+  timer.start();
+  stats_ = MrbSessionStats();
+  phase_timer_.start();
+
+  int flag_error = connect_target();
+  if( flag_error == 0 ) flag_error = process();
+
+  close_port();
+  result_ = flag_error;
+  elapsed_ms_ = timer.elapsed();
+  emit finished();
+}
+
+
+//================================================================
+/*! run a job on the kept connection. (daemon mode)
+
+  The port stays open after the job. The next job only re-syncs with
+  the target, and reuses the verified target version. (a job that
+  executes the programs closes the port. reuse needs --no-execute)
+  emit job_finished() signal at the end.
+
+  @param	job	files and actions.
+*/
+void MrbSession::run_job( const MrbSessionJob &job )
+{
+  int flag_error = 1;
+  QElapsedTimer timer;
+  timer.start();
+  stats_ = MrbSessionStats();
+  phase_timer_.start();
+
+  images_ = job.images;
+  opt_force_ = job.force;
+  opt_compress_ = job.compress;
+  opt_execute_ = job.execute;
+  opt_verify_ = job.verify;
+
+  if( serial_port_.isOpen() && target_verified_ ) {
+    out() << tr("Sync with the target.") << Qt::endl;
+    flag_error = sync_target();
+    if( flag_error == 0 ) flag_error = drain_probes();
+    if( flag_error == 0 ) {
+      out() << tr("OK. (%1 ms)").arg(timer.elapsed()) << Qt::endl;
+      stats_.connect_ms = timer.elapsed();
+      phase_end("sync");
+    } else {
+      close_port();
+    }
+  }
+  if( !serial_port_.isOpen() ) flag_error = connect_target();
+  if( flag_error == 0 ) flag_error = process();
+
+  // start over with a new connection after an error.
+  if( flag_error ) close_port();
+  result_ = flag_error;
+  elapsed_ms_ = timer.elapsed();
+  emit job_finished();
+}
+
+
+//================================================================
+/*! process the connected target.
+
+  switch speed, clear, write all files and execute.
+
+  @retval	int	0: no error
+*/
+int MrbSession::process()
+{
+  int flag_error = 0;
+  int n_keep = 0;
+  int n_target = 0;
+
+  /*
+    switch to a higher baud rate, if requested.
+  */
+  if( switch_baud_rate_ > 0 ) {
+    if( switch_speed() != 0 ) return 1;
+    phase_end("baud");
+  }
+
+  /*
+    use the binary frame mode, if the target supports it.
+  */
+  start_frame_mode();
+
+  /*
+    nothing to write. (daemon job)
+  */
+  if( images_.isEmpty() ) goto SHOW_PROG;
+
+  /*
+    check all files before erasing anything.
+  */
+  flag_error = check_rite_version();
+  if( flag_error ) return flag_error;
+
+  /*
+    skip the programs that are already on the target.
+  */
+  if( !opt_force_ && target_extensions_.contains("hashprog") ) {
+    n_keep = compare_programs( &n_target );
+    phase_end("hashprog");
+    if( n_keep == images_.size() && n_keep == n_target ) {
+      out() << tr("Programs are up to date.") << Qt::endl;
+      goto VERIFY;
+    }
+  }
+
+  /*
+    clear existed bytecode.
+  */
+  flag_error = clear_bytecode( n_keep );
+  if( flag_error && n_keep > 0 ) {
+    n_keep = 0;
+    flag_error = clear_bytecode( n_keep );
+  }
+  if( flag_error && !target_rite_version_.isEmpty() ) return flag_error;
+  phase_end("clear");
+
+  /*
+    open .mrb files and write target.
+    (pipelined in the frame mode, all at once if the target supports
+     'mwrite', otherwise one by one)
+  */
+  if( frame_mode_ ) {
+    flag_error = write_frames( images_.mid( n_keep ));
+    if( flag_error ) return flag_error;
+    phase_end( "write", stats_.bytes_sent );
+    goto VERIFY;
+  }
+  flag_error = write_files( images_.mid( n_keep ) );
+  if( flag_error > 0 ) return flag_error;
+  if( flag_error == 0 ) phase_end( "mwrite", stats_.bytes_sent );
+  if( flag_error < 0 ) {
+    flag_error = 0;
+    for( int i = n_keep; i < images_.size(); i++ ) {
+      const MrbImage &image = images_[i];
+
+      out() << tr("Writing %1").arg(image.filename()) << Qt::endl;
+      qint64 bytes_sent = stats_.bytes_sent;
+      flag_error = write_file( image.data() );
+
+      if( flag_error ) return flag_error;
+      phase_end( "write " + image.filename(), stats_.bytes_sent - bytes_sent );
+    }
+  }
+
+  /*
+    verify the programs on the target, if requested.
+  */
+ VERIFY:
+  if( opt_verify_ ) {
+    flag_error = verify_programs();
+    phase_end("verify");
+    if( flag_error ) return flag_error;
+  }
+
+  /*
+    display program list
+   */
+ SHOW_PROG:
+  show_prog();
+  phase_end("showprog");
+
+  /*
+    execute program
+  */
+  if( opt_execute_ ) {
+    execute_program();
+    phase_end("execute");
+  }
+
+  return flag_error;
+}
+
+
+//================================================================
+/*! connect target board.
+
+  Probes the target right after the port is opened, and backs off
+  only while the target stays silent.
+
+  @retval    int
+*/
+int MrbSession::connect_target()
+{
+  const int OPEN_TIMEOUT_MS = 5000;
+  int n_try = 0;
+  int wait_ms, ret;
+  QElapsedTimer timer;
+  timer.start();
+
+  out() << tr("Start connection.") << Qt::endl;
+
+ REDO:
+  if( n_try > 0 ) stats_.n_retries++;
+  if( ++n_try > 10 ) {
+    out() << tr("Try over 10 times.") << Qt::endl;
+    return 1;
+  }
+
+  // trying to open serial port.
+  VERBOSE( tr("Trying to open '%1'.").arg(line_) );
+  {
+    QDeadlineTimer deadline( OPEN_TIMEOUT_MS );
+    wait_ms = 10;
+    while( 1 ) {
+      ret = setup_serial_port();
+      if( ret != 1 || deadline.hasExpired() ) break;
+      sleep_ms( wait_ms );
+      wait_ms = qMin( wait_ms * 2, 100 );
+    }
+  }
+  switch( ret ) {
+  case 1:
+    out() << tr("Can't open serial port line.") << Qt::endl;
+    return 1;
+  case 2:
+    out() << tr("Can't set baud rate.") << Qt::endl;
+    return 1;
+  }
+  VERBOSE(tr("Serial port is ready. (%1 ms)").arg(timer.elapsed()));
+  phase_end("open");
+
+  // trying to connect target
+  VERBOSE("Trying to connect target.");
+  ret = sync_target();
+  if( ret < 0 ) {
+    VERBOSE("Serial port error has detected. Retrying.");
+    serial_port_.close();
+    sleep_ms( 100 );
+    goto REDO;
+  }
+  if( ret > 0 ) return 1;
+  out() << tr("OK. (%1 ms)").arg(timer.elapsed()) << Qt::endl;
+  phase_end("connect");
+
+  // check target version
+  VERBOSE(tr("Check target version."));
+  QString target_version = read_version();
+
+  // (for backword compatibility)
+  if( target_version.startsWith("+OK mruby/c PSoC_5LP v1.00 ") ||
+      target_version.startsWith("+OK mruby/c v2.1")) {
+    ret = 0;
+  } else {
+    QStringList vers = target_version.split(' ');
+    target_rite_version_ = vers[3];
+    target_extensions_ = vers.mid(5);
+    ret = (vers[4] != PROTOCOL_VERSION);
+  }
+
+  if( ret ) {
+    out() << tr("protocol version mismatch.") << Qt::endl;
+  } else {
+    VERBOSE(tr("Target firmware version OK."));
+  }
+  target_verified_ = (ret == 0);
+  stats_.connect_ms = timer.elapsed();
+  phase_end("version");
+
+  return ret;
+}
+
+
+//================================================================
+/*! send sync probes (CRLF) until the target answers.
+
+  @retval	int	0: synced, 1: no answer, -1: port error.
+*/
+int MrbSession::sync_target()
+{
+  const int CONN_TIMEOUT_MS = 6000;
+  const int PROBE_MIN_MS = 20;
+  const int PROBE_MAX_MS = 500;
+  QDeadlineTimer deadline( CONN_TIMEOUT_MS );
+  int wait_ms = PROBE_MIN_MS;
+
+  // the probe also brings the target back from the frame mode.
+  frame_mode_ = false;
+  serial_port_.clear();
+  while( 1 ) {
+    if( serial_port_.error() != QSerialPort::NoError ) return -1;
+    if( deadline.hasExpired() ) {
+      if( prefix_.isEmpty() ) qout_ << "\r                 \r";
+      out() << tr("Can't connect target device.") << Qt::endl;
+      return 1;
+    }
+
+    serial_port_.write("\r\n");
+    serial_port_.flush();
+    stats_.n_probes++;
+    VERBOSE("\n==> '\\r\\n' to target for connection start.");
+
+    QString r = get_line( wait_ms );
+    VERBOSE(tr("<== '%1'").arg(r.trimmed()));
+    if( r.startsWith("+OK mruby/c") ) break;
+    if( !r.startsWith( STR_CANCEL )) continue;
+
+    // no response. back off.
+    if( prefix_.isEmpty() ) {
+      qout_ << ".";
+      qout_.flush();
+    }
+    wait_ms = qMin( wait_ms * 2, PROBE_MAX_MS );
+  }
+  if( prefix_.isEmpty() ) qout_ << "\r                 \r";
+
+  return 0;
+}
+
+
+//================================================================
+/*! skip the replies to the extra sync probes on a kept connection.
+
+  Probes sent in a shorter window may still be answered after the
+  first "+OK mruby/c". Sends 'version', whose reply comes after all
+  of them, so that the next command gets its own reply.
+
+  @retval	int	0: no error, 1: no version reply.
+*/
+int MrbSession::drain_probes()
+{
+  QString r = read_version();
+  if( !r.startsWith("+OK mruby/c") ) {
+    out() << tr("Can't connect target device.") << Qt::endl;
+    return 1;
+  }
+  return 0;
+}
+
+
+//================================================================
+/*! close the serial port.
+*/
+void MrbSession::close_port()
+{
+  if( serial_port_.isOpen() ) {
+    VERBOSE( tr("Closing serial port."));
+    serial_port_.close();
+  }
+  target_verified_ = false;
+  frame_mode_ = false;
+}
+
+
+//================================================================
+/*! send 'version' command and read the response.
+
+  Skips the replies to extra sync probes that may still arrive.
+
+  @return	version string. (trimmed)
+*/
+QString MrbSession::read_version()
+{
+  QString r;
+
+  serial_port_.write("version\r\n");
+  VERBOSE(tr("==> 'version'"));
+
+  do {
+    r = get_line().trimmed();
+    VERBOSE(tr("<== '%1'").arg(r));
+  } while( r == "+OK mruby/c" );
+
+  return r;
+}
+
+
+//================================================================
+/*! switch to a higher baud rate.
+
+  Proposes the new speed, and verifies it with a test pattern in both
+  directions. The target keeps the new speed only when the host
+  confirms that it got the echo. Otherwise both fall back to the
+  current speed. (if the confirmation reply is lost, the target may
+  have kept the new speed. it is searched at both speeds)
+
+  @retval	int	0: switched or fell back.  1: lost the target.
+*/
+int MrbSession::switch_speed()
+{
+  if( !target_extensions_.contains("baud") ) {
+    VERBOSE(tr("Target does not support baud rate switching."));
+    return 0;
+  }
+
+  out() << tr("Switch baud rate to %1.").arg(switch_baud_rate_) << Qt::endl;
+  QString cmd = QString("baud %1").arg( switch_baud_rate_ );
+  if( chat( cmd.toLocal8Bit() ) != 0 ) {
+    out() << tr("Target refused. Keep %1.").arg(serial_baud_rate_) << Qt::endl;
+    return 0;
+  }
+
+  // check the test pattern at the new speed.
+  if( serial_port_.setBaudRate( switch_baud_rate_ )) {
+    serial_port_.clear();
+    serial_port_.write( BAUD_TEST_PATTERN );
+    serial_port_.write( "\r\n" );
+    VERBOSE(tr("==> '%1'").arg(BAUD_TEST_PATTERN));
+
+    QString r = get_line( BAUD_TEST_TIMEOUT_MS ).trimmed();
+    VERBOSE(tr("<== '%1'").arg(r));
+    if( r == QString("+OK ") + BAUD_TEST_PATTERN ) {
+      // confirm it. the target keeps the new speed.
+      serial_port_.write( BAUD_CONFIRM );
+      serial_port_.write( "\r\n" );
+      VERBOSE(tr("==> '%1'").arg(BAUD_CONFIRM));
+
+      r = get_line( BAUD_TEST_TIMEOUT_MS ).trimmed();
+      VERBOSE(tr("<== '%1'").arg(r));
+      if( r == "+OK" ) {
+        out() << tr("OK.") << Qt::endl;
+        return 0;
+      }
+    }
+  }
+
+  // fall back to the former speed.
+  out() << tr("Baud rate check failed. Keep %1.").arg(serial_baud_rate_) << Qt::endl;
+  sleep_ms( TARGET_BAUD_TIMEOUT_MS );
+
+  foreach( int baud, QList<int>() << serial_baud_rate_ << switch_baud_rate_ ) {
+    if( !serial_port_.setBaudRate( baud )) continue;
+    serial_port_.clear();
+
+    for( int i = 0; i < 5; i++ ) {
+      serial_port_.write("\r\n");
+      QString r = get_line( 200 );
+      VERBOSE(tr("<== '%1'").arg(r.trimmed()));
+      if( r.startsWith("+OK mruby/c") ) {
+        if( baud != serial_baud_rate_ ) {
+          out() << tr("The target has kept %1.").arg(baud) << Qt::endl;
+        }
+        read_version();
+        return 0;
+      }
+    }
+  }
+
+  out() << tr("Lost the target.") << Qt::endl;
+  return 1;
+}
+
+
+//================================================================
+/*! switch to the MRBW2 frame mode, if the target supports it.
+
+  The reply is "+OK MRBW2 (window) (max payload)". Falls back to the
+  text mode if the target refuses.
+*/
+void MrbSession::start_frame_mode()
+{
+  if( !opt_mrbw2_ || !target_extensions_.contains("mrbw2") ) return;
+
+  QString r;
+  if( chat("mrbw2", &r) != 0 ) {
+    VERBOSE(tr("Target refused. Keep the text mode."));
+    return;
+  }
+
+  QStringList col = r.split(' ');
+  frame_window_ = col.value(2).toInt();
+  frame_max_payload_ = col.value(3).toInt();
+  frame_rx_.clear();
+  frame_lines_.clear();
+  frame_mode_ = true;
+  VERBOSE(tr("Frame mode. (window %1, max payload %2)").arg(frame_window_).arg(frame_max_payload_));
+}
+
+
+//================================================================
+/*! check the RITE version of all files with the target.
+
+  @retval	int	0: no error
+*/
+int MrbSession::check_rite_version()
+{
+  if( target_rite_version_.isEmpty() ) return 0;
+
+  foreach( const MrbImage &image, images_ ) {
+    if( target_rite_version_ != image.data().left(8) ) {
+      out() << tr("mrb file RITE version mismatch. '%1'").arg(image.filename()) << Qt::endl;
+      return 2;
+    }
+  }
+  VERBOSE(tr("RITE version '%1' check OK.").arg(target_rite_version_));
+
+  return 0;
+}
+
+
+//================================================================
+/*! compare the programs on the target with the files.
+
+  @param	n_target	(out) number of programs on the target.
+  @return	number of leading programs that are unchanged.
+*/
+int MrbSession::compare_programs( int *n_target )
+{
+  QStringList target_hashes;
+  QString r;
+
+  *n_target = 0;
+  VERBOSE(tr("==> 'hashprog'"));
+  send_command("hashprog");
+
+  r = get_line().trimmed();
+  VERBOSE(tr("<== '%1'").arg(r));
+  if( !r.startsWith("+OK") ) return 0;
+
+  // read "index size crc32" lines.
+  while( 1 ) {
+    r = get_line().trimmed();
+    VERBOSE(tr("<== '%1'").arg(r));
+    if( r.startsWith("+DONE") ) break;
+    if( r.startsWith( STR_CANCEL )) {
+      stats_.n_timeouts++;
+      return 0;
+    }
+    if( r.startsWith("-ERR") ) return 0;
+
+    QStringList col = r.split(' ');
+    if( col.size() >= 3 ) target_hashes << col[1] + " " + col[2];
+  }
+  *n_target = target_hashes.size();
+
+  int n;
+  for( n = 0; n < images_.size() && n < target_hashes.size(); n++ ) {
+    const QByteArray &data = images_[n].data();
+    QString hash = QString("%1 %2").arg( data.size() )
+      .arg( calc_crc32( data.constData(), data.size() ), 8, 16, QChar('0') );
+    if( hash != target_hashes[n] ) break;
+    VERBOSE(tr("'%1' is unchanged.").arg(images_[n].filename()));
+  }
+
+  return n;
+}
+
+
+//================================================================
+/*! clear existed mruby/c bytecode.
+
+  @param	n_keep	number of leading programs to keep.
+*/
+int MrbSession::clear_bytecode( int n_keep )
+{
+  int ret;
+
+  if( n_keep == 0 ) {
+    out() << tr("Clear existed bytecode.") << Qt::endl;
+    ret = chat("clear");
+  } else {
+    out() << tr("Keep %1 unchanged program(s), clear the rest.").arg(n_keep) << Qt::endl;
+    ret = chat( QString("clear %1").arg(n_keep).toLocal8Bit() );
+  }
+
+  if( ret < 0 ) {
+    out() << tr("Bytecode clear error.") << Qt::endl;
+    return 1;
+  }
+  VERBOSE("Clear bytecode OK.");
+  return 0;
+}
+
+
+//================================================================
+/*! show program list
+*/
+int MrbSession::show_prog()
+{
+  VERBOSE(tr("==> 'showprog'"));
+  send_command("showprog");
+
+  QString r;
+
+  while( 1 ) {
+    r = get_line();
+    if( r.startsWith("+DONE")) break;
+    if( r.startsWith( STR_CANCEL )) break;
+    out() << r;
+  }
+  VERBOSE(tr("<== '%1'").arg(r.trimmed()));
+
+  return 0;
+}
+
+
+//================================================================
+/*! verify the programs on the target. (--verify)
+
+  Compares the CRC32 of each program in the target FLASH with the
+  file by 'crc', and reads a mismatched program back by 'read' to
+  show where it differs. Targets without 'crc' are checked by the
+  'hashprog' list.
+
+  @retval	int	0: no error
+*/
+int MrbSession::verify_programs()
+{
+  if( !target_extensions_.contains("crc") ) {
+    if( !target_extensions_.contains("hashprog") ) {
+      out() << tr("Target can't verify.") << Qt::endl;
+      return 1;
+    }
+
+    int n_target;
+    int n = compare_programs( &n_target );
+    if( n < images_.size() ) {
+      out() << tr("Verify error. '%1'").arg(images_[n].filename()) << Qt::endl;
+      return 1;
+    }
+    out() << tr("Verify OK.") << Qt::endl;
+    return 0;
+  }
+
+  // the programs are stored from the top, each aligned to 4 bytes.
+  //  (all 'crc' commands are sent at once in the frame mode)
+  QList<QByteArray> cmds;
+  QList<qint64> offsets;
+  qint64 offset = 0;
+  foreach( const MrbImage &image, images_ ) {
+    const QByteArray &data = image.data();
+    cmds << QString("crc %1 %2").arg(offset).arg(data.size()).toLocal8Bit();
+    offsets << offset;
+    offset += data.size() + (-data.size() & 3);	// align 4 byte.
+  }
+
+  QStringList replies;
+  if( chat_all( cmds, &replies ) != 0 ) {
+    out() << tr("Verify error. '%1'").arg(replies.value( replies.size() - 1 )) << Qt::endl;
+    return 1;
+  }
+
+  for( int idx = 0; idx < images_.size(); idx++ ) {
+    const MrbImage &image = images_[idx];
+    const QByteArray &data = image.data();
+    quint32 crc = calc_crc32( data.constData(), data.size() );
+    if( replies[idx].section(' ', 1, 1).toUInt( 0, 16 ) != crc ) {
+      out() << tr("Verify error. '%1'").arg(image.filename()) << Qt::endl;
+
+      // find the differences.
+      QByteArray flash;
+      if( target_extensions_.contains("read") &&
+          read_flash( offsets[idx], data.size(), &flash ) == 0 ) {
+        int first = -1;
+        int n_diff = 0;
+        for( int i = 0; i < data.size(); i++ ) {
+          if( data[i] == flash[i] ) continue;
+          if( first < 0 ) first = i;
+          n_diff++;
+        }
+        if( first >= 0 ) {
+          out() << tr("  %1 bytes differ, first at %2. (file %3, target %4)")
+            .arg(n_diff).arg(first)
+            .arg(quint8(data[first]), 2, 16, QChar('0'))
+            .arg(quint8(flash[first]), 2, 16, QChar('0')) << Qt::endl;
+        }
+      }
+      return 1;
+    }
+    VERBOSE(tr("'%1' is verified.").arg(image.filename()));
+  }
+
+  out() << tr("Verify OK.") << Qt::endl;
+  return 0;
+}
+
+
+//================================================================
+/*! read the target FLASH back by 'read'.
+
+  @param	offset	offset from the top of the program area.
+  @param	size	size to read.
+  @param	data	(out) read data.
+  @retval	int	0: no error
+*/
+int MrbSession::read_flash( qint64 offset, int size, QByteArray *data )
+{
+  // in the frame mode, read in pieces at once.
+  //  each response is "+OK\r\n" (data) "+DONE\r\n".
+  if( frame_mode_ ) {
+    QList<QByteArray> cmds;
+    for( int pos = 0; pos < size; pos += MRBW2_MAX_READ ) {
+      int n = qMin( MRBW2_MAX_READ, size - pos );
+      cmds << QString("read %1 %2").arg(offset + pos).arg(n).toLocal8Bit();
+    }
+
+    QList<QByteArray> responses;
+    if( request_all( cmds, &responses ) != 0 ) {
+      out() << tr("Read timeout.") << Qt::endl;
+      stats_.n_timeouts++;
+      return 1;
+    }
+    data->clear();
+    for( int i = 0; i < responses.size(); i++ ) {
+      const QByteArray &r = responses[i];
+      int n = qMin( MRBW2_MAX_READ, size - i * MRBW2_MAX_READ );
+      if( !r.startsWith("+OK\r\n") || r.size() < 5 + n ) {
+        out() << tr("Read error. '%1'").arg( QString(r).trimmed() ) << Qt::endl;
+        return 1;
+      }
+      data->append( r.constData() + 5, n );
+    }
+    return 0;
+  }
+
+  if( chat( QString("read %1 %2").arg(offset).arg(size).toLocal8Bit() ) != 0 ) return 1;
+
+  // the data follows "+OK" as is. (the timeout is for idle time)
+  const int timeout_ms = opt_timeout_ * 1000;
+  QDeadlineTimer deadline( timeout_ms );
+  while( serial_port_.bytesAvailable() < size ) {
+    qint64 n = serial_port_.bytesAvailable();
+    if( !wait_event( deadline ) && serial_port_.bytesAvailable() < size ) {
+      out() << tr("Read timeout.") << Qt::endl;
+      stats_.n_timeouts++;
+      return 1;
+    }
+    if( serial_port_.bytesAvailable() > n ) deadline.setRemainingTime( timeout_ms );
+  }
+  *data = serial_port_.read( size );
+
+  return read_status();
+}
+
+
+//================================================================
+/*! write a file.
+
+  @param	data	file image.
+  @retval	int	0: no error
+*/
+int MrbSession::write_file( const QByteArray &data )
+{
+  int filesize = data.size();
+
+  // compress it, if the target supports 'zwrite'.
+  // or, send it in blocks, if the target supports 'bwrite'.
+  //  (the image is sent as is, without a copy, unless it is compressed)
+  QByteArray payload = data;
+  QString s = QString("write %1").arg( filesize );
+  int block_size = 0;
+  if( opt_compress_ ) {
+    if( target_extensions_.contains("zwrite") ) {
+      QByteArray z = lzss_compress( data );
+      VERBOSE(tr("Compressed %1 -> %2 bytes.").arg(data.size()).arg(z.size()));
+      if( z.size() < data.size() ) {
+        s = QString("zwrite %1 %2").arg( filesize ).arg( z.size() );
+        payload = z;
+      }
+    } else {
+      VERBOSE(tr("Target does not support compressed write."));
+    }
+  }
+  if( s.startsWith("write") && target_extensions_.contains("bwrite") ) {
+    block_size = bwrite_block_size( filesize );
+    s = QString("bwrite %1 %2").arg( filesize ).arg( block_size );
+  }
+
+  // send "write" command
+  //  the target may refuse zwrite and bwrite for an image larger than its
+  //  buffer. plain 'write' streams to FLASH, so it is not limited by that.
+  int ret = chat(s.toLocal8Bit());
+  if( ret == -1 && !s.startsWith("write") ) {
+    VERBOSE(tr("Target refused. Retry by 'write'."));
+    s = QString("write %1").arg( filesize );
+    payload = data;
+    block_size = 0;
+    ret = chat(s.toLocal8Bit());
+  }
+  if( ret < 0 ) {
+    out() << "command error." << Qt::endl;
+    return 1;
+  }
+
+  // send mrb file.
+  QElapsedTimer timer;
+  timer.start();
+  if( (block_size ? send_blocks( {payload}, block_size ) : send_data( {payload} )) != 0 ) {
+    out() << tr("transfer timeout") << Qt::endl;
+    return 1;
+  }
+  VERBOSE(tr("Send %1 bytes done.").arg(payload.size()));
+
+  // check status.
+  if( read_status() != 0 ) return 1;
+
+  qint64 elapsed = qMax<qint64>( timer.elapsed(), 1 );
+  stats_.bytes_sent += payload.size();
+  stats_.transfer_ms += elapsed;
+  out() << tr("OK. (%1 bytes/s)").arg( qint64(filesize) * 1000 / elapsed ) << Qt::endl;
+  return 0;
+}
+
+
+//================================================================
+/*! write several files by one 'mwrite' command.
+
+  All files are sent back-to-back after one command, and the target
+  returns one status at the end.
+
+  @param	images	files to write.
+  @retval	int	0: no error, -1: not available (write one by one).
+*/
+int MrbSession::write_files( const QList<MrbImage> &images )
+{
+  if( images.size() < 2 || opt_compress_ ||
+      !target_extensions_.contains("mwrite") ) return -1;
+
+  QList<QByteArray> data;
+  QStringList filenames;
+  qint64 total = 0;
+  foreach( const MrbImage &image, images ) {
+    // the target splits the data by the size in each RITE header.
+    //  (the sizes have been validated before the session)
+    const QByteArray &d = image.data();
+    data << d;
+    filenames << image.filename();
+    total += d.size();
+  }
+
+  // send "mwrite" command
+  QString s = QString("mwrite %1 %2").arg( images.size() ).arg( total );
+  int block_size = 0;
+  if( target_extensions_.contains("bwrite") ) {
+    block_size = bwrite_block_size( total );
+    s += QString(" %1").arg( block_size );
+  }
+
+  out() << tr("Writing %1").arg(filenames.join(' ')) << Qt::endl;
+  int ret = chat(s.toLocal8Bit());
+  if( ret == -1 ) {
+    VERBOSE(tr("Target refused. Write one by one."));
+    return -1;
+  }
+  if( ret < 0 ) {
+    out() << "command error." << Qt::endl;
+    return 1;
+  }
+
+  // send mrb files.
+  QElapsedTimer timer;
+  timer.start();
+  if( (block_size ? send_blocks( data, block_size ) : send_data( data )) != 0 ) {
+    out() << tr("transfer timeout") << Qt::endl;
+    return 1;
+  }
+  VERBOSE(tr("Send %1 bytes done.").arg(total));
+
+  // check status.
+  if( read_status() != 0 ) return 1;
+
+  qint64 elapsed = qMax<qint64>( timer.elapsed(), 1 );
+  stats_.bytes_sent += total;
+  stats_.transfer_ms += elapsed;
+  out() << tr("OK. (%1 bytes/s)").arg( total * 1000 / elapsed ) << Qt::endl;
+  return 0;
+}
+
+
+//================================================================
+/*! read the status after sending bytecode.
+
+  @retval	int	0: +DONE received.
+*/
+int MrbSession::read_status()
+{
+  while(1) {
+    QString r = get_line();
+    VERBOSE(tr("<== '%1'").arg(r.trimmed()));
+
+    if( r.startsWith( STR_CANCEL )) {
+      out() << tr("transfer timeout") << Qt::endl;
+      stats_.n_timeouts++;
+      return 1;
+    }
+    if( r.startsWith("+DONE")) break;
+    if( r.startsWith("-ERR")) {
+      out() << tr("transfer error. '%1'").arg(r.trimmed()) << Qt::endl;
+      return 1;
+    }
+    if( r.startsWith("+ACK") || r.startsWith("-NAK") ) continue;
+    out() << r << Qt::endl;
+  }
+
+  return 0;
+}
+
+
+//================================================================
+/*! block size for 'bwrite' frames.
+
+  @param	size	data size.
+  @return	block size.
+*/
+int MrbSession::bwrite_block_size( int size )
+{
+  return qMax( BWRITE_MIN_BLOCK_SIZE, (size + BWRITE_MAX_BLOCKS - 1) / BWRITE_MAX_BLOCKS );
+}
+
+
+//================================================================
+/*! send data to the serial port in large blocks.
+
+  Hands the data over in chunks so that the OS transmit queue stays
+  full, instead of waiting for each byte to be written.
+  The pieces are sent back-to-back straight from their buffers.
+
+  @param	data	pieces of data to send.
+  @retval	int	0: no error
+*/
+int MrbSession::send_data( const QList<QByteArray> &data )
+{
+  const qint64 CHUNK_SIZE = 4096;
+  const int timeout_ms = opt_timeout_ * 1000;
+  int idx = 0;
+  qint64 pos = 0;
+  qint64 total = 0;
+  qint64 written = 0;
+
+  foreach( const QByteArray &d, data ) total += d.size();
+
+  while( idx < data.size() || serial_port_.bytesToWrite() > 0 ) {
+    while( idx < data.size() && serial_port_.bytesToWrite() < CHUNK_SIZE ) {
+      const QByteArray &d = data[idx];
+      qint64 n = serial_port_.write( d.constData() + pos,
+                                     qMin( CHUNK_SIZE, d.size() - pos ));
+      if( n < 0 ) return 1;
+      pos += n;
+      written += n;
+      if( pos >= d.size() ) {
+        idx++;
+        pos = 0;
+      }
+      emit progress( written, total );
+    }
+    if( !wait_event( QDeadlineTimer( timeout_ms ))) {
+      stats_.n_timeouts++;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+//================================================================
+/*! make a 'bwrite' frame.
+
+  frame: STX(0x02) seq(2) len(2) hdr_chk(1) data(len) crc32(4)
+    multi-byte values are big endian.
+    hdr_chk = ~(seq[0] ^ seq[1] ^ len[0] ^ len[1])
+
+  @param	data		pieces of the whole data.
+  @param	total		total size of the data.
+  @param	seq		block number.
+  @param	block_size	block size.
+  @return	frame.
+*/
+static QByteArray make_block_frame( const QList<QByteArray> &data, qint64 total,
+                                    int seq, int block_size )
+{
+  qint64 offset = qint64(seq) * block_size;
+  int len = qMin<qint64>( block_size, total - offset );
+  QByteArray frame;
+
+  frame.reserve( len + 10 );
+  frame.append( char(0x02) );
+  frame.append( char(seq >> 8) );
+  frame.append( char(seq) );
+  frame.append( char(len >> 8) );
+  frame.append( char(len) );
+  frame.append( char(~(frame[1] ^ frame[2] ^ frame[3] ^ frame[4])) );
+
+  // gather the block. (it may span the pieces)
+  qint64 base = 0;
+  foreach( const QByteArray &d, data ) {
+    qint64 s = qMax( offset, base );
+    qint64 e = qMin( offset + len, base + d.size() );
+    if( s < e ) frame.append( d.constData() + (s - base), e - s );
+    base += d.size();
+  }
+
+  quint32 crc = calc_crc32( frame.constData() + 6, len );
+  for( int i = 24; i >= 0; i -= 8 ) {
+    frame.append( char(crc >> i) );
+  }
+
+  return frame;
+}
+
+
+//================================================================
+/*! send data in numbered blocks, and resend the failed ones.
+
+  The target answers "+ACK n" or "-NAK n" for each block.
+  A NAKed block is resent at once. Blocks that got no answer at all
+  are resent when the line has been idle for a while.
+
+  @param	data		pieces of data to send.
+  @param	block_size	block size.
+  @retval	int		0: no error
+*/
+int MrbSession::send_blocks( const QList<QByteArray> &data, int block_size )
+{
+  qint64 total = 0;
+  foreach( const QByteArray &d, data ) total += d.size();
+  const int n_blocks = (total + block_size - 1) / block_size;
+  // wait long enough for the OS and adapter buffers to drain,
+  // but resend before the target gives up. (at a low baud rate)
+  const int idle_ms = qMin( 200 + 2 * 4096 * 10 * 1000 / qMax( serial_port_.baudRate(), 1200 ),
+                            BWRITE_TARGET_TIMEOUT_MS / 2 );
+  QVector<bool> acked( n_blocks, false );
+  QVector<int> n_sent( n_blocks, 0 );
+  QList<int> queue;
+  int n_acked = 0;
+  int n_resent = 0;
+  QElapsedTimer idle;
+
+  for( int i = 0; i < n_blocks; i++ ) queue << i;
+  idle.start();
+
+  while( n_acked < n_blocks ) {
+    // keep the TX queue filled.
+    while( !queue.isEmpty() && serial_port_.bytesToWrite() < block_size * 4 ) {
+      int seq = queue.takeFirst();
+      if( acked[seq] ) continue;
+      if( n_sent[seq]++ > BWRITE_MAX_RETRY ) {
+        out() << tr("block %1 failed.").arg(seq) << Qt::endl;
+        return 1;
+      }
+      if( n_sent[seq] > 1 ) n_resent++;
+      serial_port_.write( make_block_frame( data, total, seq, block_size ));
+    }
+
+    wait_event( QDeadlineTimer( idle_ms ));
+    if( serial_port_.error() != QSerialPort::NoError ) return 1;
+
+    // process ACK / NAK.
+    //  (stop at the last ACK. the final status line follows it.)
+    while( n_acked < n_blocks && serial_port_.canReadLine() ) {
+      QString r = QString( serial_port_.readLine() ).trimmed();
+      VERBOSE(tr("<== '%1'").arg(r));
+      if( r.startsWith("-ERR") ) {
+        out() << tr("transfer error. '%1'").arg(r) << Qt::endl;
+        return 1;
+      }
+
+      bool ok;
+      int seq = r.section(' ', 1, 1).toInt( &ok );
+      if( !ok || seq < 0 || seq >= n_blocks || acked[seq] ) continue;
+      if( r.startsWith("+ACK") ) {
+        acked[seq] = true;
+        n_acked++;
+        idle.restart();
+        emit progress( qMin<qint64>( qint64(n_acked) * block_size, total ), total );
+      } else if( r.startsWith("-NAK") ) {
+        if( !queue.contains(seq) ) queue << seq;
+        idle.restart();
+      }
+    }
+
+    // no answer for a while. resend the blocks not acknowledged.
+    if( queue.isEmpty() && serial_port_.bytesToWrite() == 0 && idle.elapsed() >= idle_ms ) {
+      stats_.n_timeouts++;
+      for( int i = 0; i < n_blocks; i++ ) {
+        if( !acked[i] ) queue << i;
+      }
+      idle.restart();
+    }
+  }
+
+  stats_.n_retries += n_resent;
+  if( n_resent ) {
+    out() << tr("Resent %1 of %2 blocks.").arg(n_resent).arg(n_blocks) << Qt::endl;
+  }
+  return 0;
+}
+
+
+//================================================================
+/*! write files in the frame mode. (MRBW2)
+
+  Each file is a 'write' request followed by 'data (offset)' requests.
+  They are all sent without waiting for the responses, as long as the
+  bytes not yet answered fit in the target's receive window.
+
+  A broken or lost 'data' frame is answered by "-NAK (offset)", and
+  the requests are resent from that offset. The responses to the
+  requests sent before that are ignored.
+
+  @param	images	files to write.
+  @retval	int	0: no error
+*/
+int MrbSession::write_frames( const QList<MrbImage> &images )
+{
+  //! a request to send.
+  struct Request {
+    QByteArray payload;
+    int file;			//!< index of images.
+    int offset;			//!< data offset. (-1: 'write' command)
+    qint64 done;		//!< bytes written when this is answered.
+  };
+  //! a request sent, not yet answered.
+  struct Pending {
+    quint8 seq;
+    int idx;			//!< index of requests.
+    int size;			//!< frame size.
+    bool stale;			//!< sent before a rewind. ignore the response.
+  };
+
+  if( opt_compress_ ) {
+    VERBOSE(tr("Compressed write is not used in the frame mode."));
+  }
+
+  // the data frames must be multiple of 4 bytes, except the last one.
+  int chunk = qMin( frame_window_ / 4, frame_max_payload_ - 32 );
+  chunk = qBound( 64, chunk, MRBW2_MAX_DATA ) & ~3;
+
+  QList<Request> requests;
+  QStringList filenames;
+  qint64 total = 0;
+  for( int i = 0; i < images.size(); i++ ) {
+    const QByteArray &data = images[i].data();
+    requests.append({ QString("write %1").arg(data.size()).toLocal8Bit(), i, -1, total });
+    for( int pos = 0; pos < data.size(); pos += chunk ) {
+      int len = qMin( chunk, data.size() - pos );
+      QByteArray payload = QString("data %1").arg(pos).toLocal8Bit();
+      payload.append('\0');
+      payload.append( data.constData() + pos, len );
+      requests.append({ payload, i, pos, total + pos + len });
+    }
+    filenames << images[i].filename();
+    total += data.size();
+  }
+
+  out() << tr("Writing %1").arg(filenames.join(' ')) << Qt::endl;
+  QElapsedTimer timer;
+  timer.start();
+
+  QList<Pending> pending;
+  int next = 0;			// next request to send.
+  int n_done = 0;		// requests answered, in order.
+  int in_flight = 0;		// bytes sent, not yet answered.
+  int target_file = -1;		// file that the target is writing.
+  int n_sent = 0;		// requests sent at least once.
+  int last_rewind = -1;
+  int n_rewinds = 0;
+  int n_resent = 0;
+
+  while( n_done < requests.size() ) {
+    // send ahead, within the window.
+    while( next < requests.size() ) {
+      int size = requests[next].payload.size() + MRBW2_OVERHEAD;
+      if( !pending.isEmpty() && in_flight + size > frame_window_ ) break;
+      if( next < n_sent ) n_resent++; else n_sent = next + 1;
+      pending.append({ send_frame( requests[next].payload ), next, size, false });
+      in_flight += size;
+      next++;
+    }
+
+    quint8 seq;
+    QByteArray payload;
+    int rewind = -1;
+    QString r;
+
+    if( read_frame( &seq, &payload ) != 0 ) {
+      // no answer at all. resend from the first one not answered.
+      stats_.n_timeouts++;
+      pending.clear();
+      in_flight = 0;
+      if( requests[n_done].offset < 0 ) {
+        out() << tr("transfer timeout") << Qt::endl;
+        return 1;
+      }
+      rewind = n_done;
+      goto REWIND;
+    }
+
+    {
+      int k = 0;
+      while( k < pending.size() && pending[k].seq != seq ) k++;
+      if( k == pending.size() ) continue;	// not ours.
+
+      // the requests before it got no answer. (lost)
+      bool lost = false;
+      for( int i = 0; i < k; i++ ) {
+        in_flight -= pending[i].size;
+        if( !pending[i].stale ) lost = true;
+      }
+      Pending p = pending[k];
+      pending.erase( pending.begin(), pending.begin() + k + 1 );
+      in_flight -= p.size;
+      if( p.stale ) continue;
+
+      r = QString( payload.left( payload.indexOf('\n') + 1 )).trimmed();
+      if( lost ) {
+        // only the data frames are safe to resend.
+        if( requests[n_done].offset < 0 || requests[p.idx].offset < 0 ) {
+          out() << tr("transfer error. (lost frame)") << Qt::endl;
+          return 1;
+        }
+        rewind = n_done;
+        goto REWIND;
+      }
+
+      if( r.startsWith("+OK") || r.startsWith("+DONE") ) {
+        if( requests[p.idx].offset < 0 ) target_file = requests[p.idx].file;
+        n_done = p.idx + 1;
+        emit progress( requests[p.idx].done, total );
+        continue;
+      }
+      VERBOSE(tr("<== '%1'").arg(r));
+
+      if( r.startsWith("-NAK") ) {
+        int offset = r.section(' ', 1, 1).toInt();
+        for( int i = 0; i < requests.size(); i++ ) {
+          if( requests[i].file == target_file && requests[i].offset == offset ) rewind = i;
+        }
+      } else if( r.startsWith("-ERR CRC") ) {
+        rewind = p.idx;		// not executed. send it again.
+      }
+      if( rewind < 0 ) {
+        out() << tr("transfer error. '%1'").arg(r) << Qt::endl;
+        return 1;
+      }
+    }
+
+  REWIND:
+    if( rewind == last_rewind ) {
+      if( ++n_rewinds > BWRITE_MAX_RETRY ) {
+        out() << tr("frame %1 failed.").arg(rewind) << Qt::endl;
+        return 1;
+      }
+    } else {
+      last_rewind = rewind;
+      n_rewinds = 1;
+    }
+    for( int i = 0; i < pending.size(); i++ ) pending[i].stale = true;
+    next = rewind;
+    n_done = rewind;
+  }
+
+  qint64 elapsed = qMax<qint64>( timer.elapsed(), 1 );
+  stats_.bytes_sent += total;
+  stats_.transfer_ms += elapsed;
+  stats_.n_retries += n_resent;
+  if( n_resent ) {
+    out() << tr("Resent %1 of %2 frames.").arg(n_resent).arg(requests.size()) << Qt::endl;
+  }
+  out() << tr("OK. (%1 bytes/s)").arg( total * 1000 / elapsed ) << Qt::endl;
+  return 0;
+}
+
+
+//================================================================
+/*! execute program
+
+  Closes the port on success. The running program doesn't answer
+  the sync probe any more.
+*/
+void MrbSession::execute_program()
+{
+  out() << tr("Start mruby/c program.") << Qt::endl;
+
+  int ret = chat("execute");
+  frame_mode_ = false;		// the target has left the frame mode.
+  if( ret >= 0 ) {
+    out() << tr("OK.") << Qt::endl;
+    // the program runs, and the target no longer answers the sync
+    // probe. the next job connects it again. (after a reset)
+    close_port();
+  } else {
+    out() << tr("execute error.") << Qt::endl;
+  }
+}
+
+
+//================================================================
+/*! open a communication port.
+
+  @retval	int	0: no error
+*/
+int MrbSession::setup_serial_port()
+{
+  serial_port_.setPortName( line_ );
+
+  if( !serial_port_.open( QIODevice::ReadWrite )) return 1;
+  if( !serial_port_.setBaudRate( serial_baud_rate_ )) return 2;
+
+  serial_port_.setDataBits( QSerialPort::Data8 );
+  serial_port_.setParity( QSerialPort::NoParity );
+  serial_port_.setStopBits( QSerialPort::OneStop );
+  serial_port_.setFlowControl( QSerialPort::HardwareControl );
+
+  return 0;
+}
+
+
+//================================================================
+/*! get a line from serial port with timeout.
+
+  @param	timeout_ms	timeout (ms). 0 means --timeout option value.
+  @return QString
+*/
+QString MrbSession::get_line( int timeout_ms )
+{
+  // in the frame mode, the lines come from the last response frame.
+  if( frame_mode_ ) {
+    if( frame_lines_.isEmpty() ) return QString(STR_CANCEL);
+    return frame_lines_.takeFirst();
+  }
+
+  if( timeout_ms == 0 ) {
+    timeout_ms = opt_timeout_ * 1000;
+  }
+  QDeadlineTimer deadline( timeout_ms, Qt::PreciseTimer );
+
+  while( !serial_port_.canReadLine() ) {
+    if( !wait_event( deadline ) && !serial_port_.canReadLine() ) {
+      return QString(STR_CANCEL);	// Timeout
+    }
+  }
+
+  return serial_port_.readLine();
+}
+
+
+//================================================================
+/*! wait for a serial port event.
+
+  Returns as soon as the port emits readyRead or bytesWritten,
+  so that the caller can re-check its condition without polling.
+
+  @param	deadline	deadline of the wait.
+  @retval	bool		false: timeout or port error.
+*/
+bool MrbSession::wait_event( const QDeadlineTimer &deadline )
+{
+  if( deadline.hasExpired() ) return false;
+
+  QEventLoop loop;
+  QTimer timer;
+  timer.setSingleShot( true );
+  timer.setTimerType( Qt::PreciseTimer );
+  connect( &timer, &QTimer::timeout, &loop, &QEventLoop::quit );
+  connect( &serial_port_, &QSerialPort::readyRead, &loop, &QEventLoop::quit );
+  connect( &serial_port_, &QSerialPort::bytesWritten, &loop, &QEventLoop::quit );
+  connect( &serial_port_, &QSerialPort::errorOccurred, &loop, &QEventLoop::quit );
+  if( !deadline.isForever() ) timer.start( int(deadline.remainingTime()) );
+  loop.exec();
+
+  if( serial_port_.error() != QSerialPort::NoError ) return false;
+  return !deadline.hasExpired();
+}
+
+
+//================================================================
+/*! chat
+
+  @param cmd    send command.
+  @param reply  (out) the response line, if not NULL.
+  @return int   0=+OK, 1=+DONE, -1=-ERR, -2=Timeout
+*/
+int MrbSession::chat( const char *cmd, QString *reply )
+{
+  int ret;
+  QString r;
+  QElapsedTimer timer;
+  VERBOSE(tr("==> '%1'").arg(cmd));
+
+  timer.start();
+  send_command( cmd );
+
+  while( 1 ) {
+    r = get_line();
+    VERBOSE(tr("<== '%1'").arg(r.trimmed()));
+    if( r.startsWith("+OK")) { ret = 0; break; }
+    if( r.startsWith("+DONE")) { ret = 1; break; }
+    if( r.startsWith("-ERR")) { ret = -1; break; }
+    if( r.startsWith( STR_CANCEL )) {
+      out() << "TIMEOUT!" << Qt::endl;
+      stats_.n_timeouts++;
+      return -2;
+    }
+    out() << r;
+  }
+  if( reply ) *reply = r.trimmed();
+
+  qint64 rtt = timer.nsecsElapsed() / 1000;
+  stats_.n_commands++;
+  stats_.rtt_total_us += rtt;
+  stats_.rtt_max_us = qMax( stats_.rtt_max_us, rtt );
+
+  return ret;
+}
+
+
+//================================================================
+/*! chat several commands.
+
+  In the frame mode, all commands are sent at once, without waiting
+  for each response.
+
+  @param cmds     send commands.
+  @param replies  (out) the response line of each command.
+  @return int     0=all +OK or +DONE, -1=-ERR, -2=Timeout
+*/
+int MrbSession::chat_all( const QList<QByteArray> &cmds, QStringList *replies )
+{
+  replies->clear();
+
+  if( !frame_mode_ ) {
+    foreach( const QByteArray &cmd, cmds ) {
+      QString r;
+      int ret = chat( cmd, &r );
+      replies->append( r );
+      if( ret < 0 ) return ret;
+    }
+    return 0;
+  }
+
+  QElapsedTimer timer;
+  timer.start();
+  QList<QByteArray> responses;
+  if( request_all( cmds, &responses ) != 0 ) {
+    out() << "TIMEOUT!" << Qt::endl;
+    stats_.n_timeouts++;
+    return -2;
+  }
+
+  qint64 rtt = timer.nsecsElapsed() / 1000;
+  stats_.n_commands += cmds.size();
+  stats_.rtt_total_us += rtt;
+  stats_.rtt_max_us = qMax( stats_.rtt_max_us, rtt );
+
+  foreach( const QByteArray &res, responses ) {
+    QString r = QString( res.left( res.indexOf('\n') + 1 )).trimmed();
+    VERBOSE(tr("<== '%1'").arg(r));
+    replies->append( r );
+    if( r.startsWith("-ERR") ) return -1;
+  }
+
+  return 0;
+}
+
+
+//================================================================
+/*! send a command. The response is read by get_line().
+
+  In the frame mode, the command is sent in a frame, and the lines
+  in the response frame are kept for get_line().
+
+  @param cmd    send command.
+*/
+void MrbSession::send_command( const QByteArray &cmd )
+{
+  if( !frame_mode_ ) {
+    serial_port_.write( cmd );
+    serial_port_.write("\r\n");
+    return;
+  }
+
+  QList<QByteArray> responses;
+  frame_lines_.clear();
+  if( request_all( {cmd}, &responses ) != 0 ) return;
+
+  const QByteArray &res = responses[0];
+  int pos = 0;
+  while( pos < res.size() ) {
+    int end = res.indexOf('\n', pos);
+    if( end < 0 ) end = res.size() - 1;
+    frame_lines_ << QString( res.mid( pos, end - pos + 1 ));
+    pos = end + 1;
+  }
+}
+
+
+//================================================================
+/*! send a request frame. (frame mode)
+
+  frame: SOH(0x01) seq(1) len(2) hdr_chk(1) payload(len) crc32(4)
+    multi-byte values are big endian.
+    hdr_chk = ~(seq ^ len[0] ^ len[1])
+
+  @param	payload	command line, and NUL and data if any.
+  @return	seq of the frame.
+*/
+quint8 MrbSession::send_frame( const QByteArray &payload )
+{
+  quint8 seq = frame_seq_++;
+  int len = payload.size();
+  QByteArray frame;
+
+  frame.reserve( len + MRBW2_OVERHEAD );
+  frame.append( MRBW2_SOH );
+  frame.append( char(seq) );
+  frame.append( char(len >> 8) );
+  frame.append( char(len) );
+  frame.append( char(~(frame[1] ^ frame[2] ^ frame[3])) );
+  frame.append( payload );
+
+  quint32 crc = calc_crc32( payload.constData(), len );
+  for( int i = 24; i >= 0; i -= 8 ) {
+    frame.append( char(crc >> i) );
+  }
+
+  serial_port_.write( frame );
+  return seq;
+}
+
+
+//================================================================
+/*! read a response frame. (frame mode)
+
+  Broken frames are skipped. The timeout is for idle time.
+
+  @param	seq	(out) seq of the frame.
+  @param	payload	(out) payload. (the response in the text mode)
+  @retval	int	0: no error, -2: timeout
+*/
+int MrbSession::read_frame( quint8 *seq, QByteArray *payload )
+{
+  const int timeout_ms = opt_timeout_ * 1000;
+  QDeadlineTimer deadline( timeout_ms );
+
+  while( 1 ) {
+    frame_rx_.append( serial_port_.readAll() );
+
+    while( 1 ) {
+      // find a frame header.
+      int i = frame_rx_.indexOf( MRBW2_SOH );
+      if( i < 0 ) {
+        frame_rx_.clear();
+        break;
+      }
+      frame_rx_.remove( 0, i );
+      if( frame_rx_.size() < 5 ) break;
+
+      const quint8 *hdr = (const quint8 *)frame_rx_.constData();
+      if( quint8(~(hdr[1] ^ hdr[2] ^ hdr[3])) != hdr[4] ) {
+        frame_rx_.remove( 0, 1 );
+        continue;
+      }
+      int len = hdr[2] << 8 | hdr[3];
+      if( len > MRBW2_MAX_REPLY ) {	// a broken header that passed the check.
+        frame_rx_.remove( 0, 1 );
+        continue;
+      }
+      if( frame_rx_.size() < 5 + len + 4 ) break;
+
+      const quint8 *c = hdr + 5 + len;
+      quint32 crc = quint32(c[0]) << 24 | c[1] << 16 | c[2] << 8 | c[3];
+      if( crc != calc_crc32( frame_rx_.constData() + 5, len )) {
+        VERBOSE(tr("Broken frame."));
+        frame_rx_.remove( 0, 1 );
+        continue;
+      }
+
+      *seq = hdr[1];
+      *payload = frame_rx_.mid( 5, len );
+      frame_rx_.remove( 0, 5 + len + 4 );
+      return 0;
+    }
+
+    if( !wait_event( deadline ) && serial_port_.bytesAvailable() == 0 ) return -2;
+    if( serial_port_.bytesAvailable() > 0 ) deadline.setRemainingTime( timeout_ms );
+  }
+}
+
+
+//================================================================
+/*! send requests and get all responses. (frame mode)
+
+  The requests are sent without waiting for the responses, as long
+  as the bytes not yet answered fit in the target's receive window.
+
+  @param	cmds		requests.
+  @param	responses	(out) the payload of each response.
+  @retval	int		0: no error, -2: timeout or lost.
+*/
+int MrbSession::request_all( const QList<QByteArray> &cmds, QList<QByteArray> *responses )
+{
+  QList<QPair<quint8, int>> pending;	// seq and frame size.
+  int next = 0;
+  int in_flight = 0;
+
+  responses->clear();
+  while( responses->size() < cmds.size() ) {
+    while( next < cmds.size() ) {
+      int size = cmds[next].size() + MRBW2_OVERHEAD;
+      if( !pending.isEmpty() && in_flight + size > frame_window_ ) break;
+      pending.append( qMakePair( send_frame( cmds[next] ), size ));
+      in_flight += size;
+      next++;
+    }
+
+    quint8 seq;
+    QByteArray payload;
+    if( read_frame( &seq, &payload ) != 0 ) return -2;
+
+    // the responses come in order. a skipped one has been lost.
+    int k = 0;
+    while( k < pending.size() && pending[k].first != seq ) k++;
+    if( k == pending.size() ) continue;	// not ours.
+    if( k > 0 ) return -2;
+
+    in_flight -= pending.takeFirst().second;
+    responses->append( payload );
+  }
+
+  return 0;
+}
+
+
+//================================================================
+/*! record the time of a phase, and start the next one.
+
+  @param	name	phase name.
+  @param	bytes	bytecode bytes sent in the phase.
+*/
+void MrbSession::phase_end( const QString &name, qint64 bytes )
+{
+  MrbSessionPhase phase;
+  phase.name = name;
+  phase.ms = phase_timer_.restart();
+  phase.bytes = bytes;
+  stats_.phases.append( phase );
+  emit phase_finished( name, phase.ms );
+}
+
+
+//================================================================
+/*! sleep (ms)
+
+*/
+void MrbSession::sleep_ms( int ms )
+{
+  QEventLoop loop;
+  QTimer::singleShot( ms, &loop, SLOT(quit()) );
+  loop.exec();
+}
+
+
+//================================================================
+/*! output stream with the line prefix.
+
+*/
+QTextStream & MrbSession::out()
+{
+  if( opt_quiet_ ) log_.clear();
+  if( !prefix_.isEmpty() ) qout_ << prefix_;
+  return qout_;
+}
@@ -0,0 +1,183 @@
+/*! @file
+  @brief
+  mruby/c irep file writer. (one target session)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+#ifndef MRBSESSION_H
+#define MRBSESSION_H
+
+#include <QObject>
+#include <QStringList>
+#include <QTextStream>
+#include <QSerialPort>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QList>
+
+#include "mrbimage.h"
+
+
+//================================================================
+/*! MrbSession options.
+*/
+struct MrbSessionOption {
+  bool verbose = false;		//!< verbose mode.
+  int timeout = 5;		//!< command timeout (sec).
+  int baud_rate = 57600;	//!< serial baud rate.
+  int switch_baud_rate = 0;	//!< baud rate to switch to after connecting.
+  bool compress = false;	//!< use compressed write if the target supports it.
+  bool force = false;		//!< rewrite all programs even if unchanged.
+  bool quiet = false;		//!< no console output.
+  bool capture = false;		//!< keep the output for take_log().
+  bool execute = true;		//!< execute the programs at the end.
+  bool verify = false;		//!< verify the programs after writing.
+  bool mrbw2 = true;		//!< use the MRBW2 frame mode if the target supports it.
+  QList<MrbImage> images;	//!< .mrb files to write.
+};
+
+
+//================================================================
+/*! MrbSession job. (daemon mode)
+*/
+struct MrbSessionJob {
+  QList<MrbImage> images;	//!< .mrb files to write. (none: don't write)
+  bool force = false;		//!< rewrite all programs even if unchanged.
+  bool compress = false;	//!< use compressed write if the target supports it.
+  bool execute = true;		//!< execute the programs at the end.
+  bool verify = false;		//!< verify the programs after writing.
+};
+
+
+//================================================================
+/*! MrbSession phase timing.
+*/
+struct MrbSessionPhase {
+  QString name;			//!< phase name. (e.g. "clear")
+  qint64 ms = 0;		//!< wall time (ms).
+  qint64 bytes = 0;		//!< bytecode bytes sent.
+};
+
+
+//================================================================
+/*! MrbSession statistics.
+*/
+struct MrbSessionStats {
+  qint64 connect_ms = 0;	//!< handshake time. (open port to version reply)
+  int n_commands = 0;		//!< number of command round trips.
+  qint64 rtt_total_us = 0;	//!< total command round trip time. (us)
+  qint64 rtt_max_us = 0;	//!< longest command round trip time. (us)
+  qint64 bytes_sent = 0;	//!< bytecode bytes sent.
+  qint64 transfer_ms = 0;	//!< time to send bytecode and get the status.
+  int n_probes = 0;		//!< sync probes sent to connect.
+  int n_retries = 0;		//!< port reopens and resent blocks.
+  int n_timeouts = 0;		//!< responses that did not arrive in time.
+  QList<MrbSessionPhase> phases; //!< time of each phase, in order.
+};
+
+
+//================================================================
+/*! MrbSession class.
+
+  Drives one target board through connect, clear, write and execute.
+  Each session owns its serial port, so several sessions can run
+  concurrently in their own threads.
+*/
+class MrbSession : public QObject
+{
+  Q_OBJECT
+
+public:
+  MrbSession( const QString &line, const MrbSessionOption &opt );
+  void set_prefix( const QString &prefix );
+  void sleep_ms( int ms );
+
+  const QString &line() const { return line_; }
+  int result() const { return result_; }
+  qint64 elapsed_ms() const { return elapsed_ms_; }
+  const MrbSessionStats &stats() const { return stats_; }
+  QString take_log();
+
+public slots:
+  void run();
+  void run_job( const MrbSessionJob &job );
+
+signals:
+  void finished();
+  void job_finished();
+  void phase_finished( const QString &name, qint64 ms );
+  void progress( qint64 bytes, qint64 total );
+
+private:
+  QTextStream qout_;		//!< console output stream.
+  QString log_;			//!< output buffer for the quiet and capture mode.
+  QString prefix_;		//!< output line prefix.
+  bool opt_verbose_;		//!< command line option --verbose
+  int opt_timeout_;		//!< command line option --timeout
+  bool opt_compress_;		//!< command line option --compress
+  bool opt_force_;		//!< command line option --force
+  bool opt_quiet_;		//!< no console output.
+  bool opt_execute_;		//!< execute the programs at the end.
+  bool opt_verify_;		//!< verify the programs after writing.
+  bool opt_mrbw2_;		//!< use the MRBW2 frame mode.
+  QString line_;		//!< device name.
+  QList<MrbImage> images_;	//!< .mrb files to write.
+  QSerialPort serial_port_;	//!< serial port object.
+  int serial_baud_rate_;	//!< serial baud rate.
+  int switch_baud_rate_;	//!< baud rate to switch to. (0: don't switch)
+  QString target_rite_version_;	//!< target board RITE version string.
+  QStringList target_extensions_; //!< protocol extensions supported by target.
+  bool target_verified_;	//!< target version is checked on this connection.
+  bool frame_mode_;		//!< in the MRBW2 frame mode.
+  int frame_window_;		//!< bytes that may be sent ahead of the responses.
+  int frame_max_payload_;	//!< max payload size of a request frame.
+  quint8 frame_seq_;		//!< seq of the next request frame.
+  QByteArray frame_rx_;		//!< received, not yet a complete frame.
+  QStringList frame_lines_;	//!< response lines of the last request, for get_line().
+  int result_;			//!< session result. 0: no error
+  qint64 elapsed_ms_;		//!< session time (ms).
+  MrbSessionStats stats_;	//!< statistics.
+  QElapsedTimer phase_timer_;	//!< time of the current phase.
+
+  int process();
+  int connect_target();
+  int sync_target();
+  int drain_probes();
+  void close_port();
+  QString read_version();
+  int switch_speed();
+  void start_frame_mode();
+  int check_rite_version();
+  int compare_programs( int *n_target );
+  int clear_bytecode( int n_keep = 0 );
+  int show_prog();
+  int verify_programs();
+  int read_flash( qint64 offset, int size, QByteArray *data );
+  int write_file( const QByteArray &data );
+  int write_files( const QList<MrbImage> &images );
+  int read_status();
+  int bwrite_block_size( int size );
+  int send_data( const QList<QByteArray> &data );
+  int send_blocks( const QList<QByteArray> &data, int block_size );
+  int write_frames( const QList<MrbImage> &images );
+  void execute_program();
+  int setup_serial_port();
+  QString get_line( int timeout_ms = 0 );
+  bool wait_event( const QDeadlineTimer &deadline );
+  int chat( const char *cmd, QString *reply = 0 );
+  int chat_all( const QList<QByteArray> &cmds, QStringList *replies );
+  void send_command( const QByteArray &cmd );
+  quint8 send_frame( const QByteArray &payload );
+  int read_frame( quint8 *seq, QByteArray *payload );
+  int request_all( const QList<QByteArray> &cmds, QList<QByteArray> *responses );
+  void phase_end( const QString &name, qint64 bytes = 0 );
+  QTextStream &out();
+};
+
+#endif
@@ -0,0 +1,195 @@
+/*! @file
+  @brief
+  mruby/c irep file writer. (hot-plug watch mode)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+
+#include <QRegularExpression>
+#include <QSerialPortInfo>
+
+#include "mrbwatcher.h"
+
+#define VERBOSE(s) if( opt_.verbose ) { qout_ << s << Qt::endl; }
+
+static const int POLL_INTERVAL_MS = 300;
+static const int PROBE_TIMEOUT_MS = 10000;	//!< give up a port that stays silent.
+
+
+//================================================================
+/*! constructor
+
+  @param	opt		session options and images.
+  @param	patterns	device names to watch. (wildcards. empty or 'auto': all)
+  @param	filter		USB device filter.
+  @param	parent		parent object.
+*/
+MrbWatcher::MrbWatcher( const MrbSessionOption &opt, const QStringList &patterns,
+                        const MrbPortFilter &filter, QObject *parent )
+  : QObject( parent ),
+    qout_(stdout),
+    opt_(opt),
+    filter_(filter),
+    n_arrivals_(0),
+    n_pass_(0),
+    n_fail_(0),
+    total_cycle_ms_(0)
+{
+  foreach( const QString &s, patterns ) {
+    if( s != "auto" ) patterns_ << s;
+  }
+
+  detector_.set_baud_rate( opt_.baud_rate );
+  timer_.setInterval( POLL_INTERVAL_MS );
+  connect( &timer_, &QTimer::timeout, this, &MrbWatcher::poll );
+  connect( &detector_, &MrbDetector::found, this, &MrbWatcher::port_found );
+  connect( &detector_, &MrbDetector::not_found, this, &MrbWatcher::port_not_found );
+  connect( &writer_, &MrbWriter::finished, this, &MrbWatcher::job_finished );
+}
+
+
+//================================================================
+/*! start watching. runs until the process is killed.
+
+  The ports already present are written too.
+*/
+void MrbWatcher::start()
+{
+  qout_ << tr("Watching the ports. (Ctrl-C to quit)") << Qt::endl;
+  poll();
+  timer_.start();
+}
+
+
+//================================================================
+/*! is the port to watch?
+
+  @param	info	port.
+  @retval	bool	true: watch it.
+*/
+bool MrbWatcher::match( const QSerialPortInfo &info ) const
+{
+  if( !filter_.match( info )) return false;
+  if( patterns_.isEmpty() ) return true;
+
+  foreach( const QString &pattern, patterns_ ) {
+    QRegularExpression re( QRegularExpression::wildcardToRegularExpression( pattern ));
+    if( re.match( info.portName() ).hasMatch() ||
+        re.match( info.systemLocation() ).hasMatch() ) return true;
+  }
+  return false;
+}
+
+
+//================================================================
+/*! check the arrival and removal of ports, and probe the new ones.
+*/
+void MrbWatcher::poll()
+{
+  QList<QSerialPortInfo> to_probe;
+  QStringList present;
+
+  foreach( const QSerialPortInfo &info, QSerialPortInfo::availablePorts() ) {
+    if( !match( info )) continue;
+    QString key = info.systemLocation();
+    present << key;
+
+    if( !ports_.contains( key )) {
+      Port port;
+      port.name = info.portName();
+      port.generation = ++n_arrivals_;
+      port.arrived.start();
+      ports_.insert( key, port );
+      VERBOSE( tr("%1: arrived.").arg(port.name) );
+    }
+
+    Port &port = ports_[key];
+    if( port.state == PROBING && !port.probing ) {
+      port.probing = true;
+      to_probe << info;
+    }
+  }
+
+  // removed ports. (a running session fails by itself)
+  foreach( const QString &key, ports_.keys() ) {
+    if( present.contains( key )) continue;
+    VERBOSE( tr("%1: removed.").arg(ports_[key].name) );
+    ports_.remove( key );
+  }
+
+  if( !to_probe.isEmpty() ) detector_.start( to_probe );
+}
+
+
+//================================================================
+/*! a target has answered on a new port. write it.
+*/
+void MrbWatcher::port_found( const QSerialPortInfo &info )
+{
+  QString key = info.systemLocation();
+  if( !ports_.contains( key )) return;
+
+  Port &port = ports_[key];
+  port.probing = false;
+  port.state = WRITING;
+  qout_ << tr("%1: target found. (%2 ms)").arg(port.name).arg(port.arrived.elapsed()) << Qt::endl;
+
+  int id = writer_.start( port.name, opt_, QString("[%1] ").arg(port.name) );
+  jobs_.insert( id, qMakePair( key, port.generation ));
+}
+
+
+//================================================================
+/*! no answer on a new port. probe it again at the next poll.
+*/
+void MrbWatcher::port_not_found( const QSerialPortInfo &info )
+{
+  QString key = info.systemLocation();
+  if( !ports_.contains( key )) return;
+
+  Port &port = ports_[key];
+  port.probing = false;
+  if( port.arrived.elapsed() >= PROBE_TIMEOUT_MS ) {
+    port.state = DONE;
+    VERBOSE( tr("%1: no target. Ignored until removed.").arg(port.name) );
+  }
+}
+
+
+//================================================================
+/*! a session has finished. count it.
+
+  The port is marked only if it is still the same arrival. (another
+  board may have been plugged in at the same location meanwhile)
+
+  @param	id	job id.
+  @param	r	result of the session.
+*/
+void MrbWatcher::job_finished( int id, const MrbWriterResult &r )
+{
+  QPair<QString, int> job = jobs_.take( id );
+  const QString &key = job.first;
+  qint64 cycle_ms = r.elapsed_ms;
+  if( ports_.contains( key ) && ports_[key].generation == job.second ) {
+    Port &port = ports_[key];
+    port.state = DONE;
+    cycle_ms = port.arrived.elapsed();
+  }
+
+  if( r.result == 0 ) n_pass_++; else n_fail_++;
+  total_cycle_ms_ += cycle_ms;
+
+  qout_ << QString("%1 %2 %3 ms")
+    .arg( r.line, -16 )
+    .arg( QString( r.result == 0 ? "OK" : "ERROR" ), -6 )
+    .arg( cycle_ms, 6 ) << Qt::endl;
+  qout_ << tr("Total: %1 passed, %2 failed, cycle avg %3 ms.")
+    .arg(n_pass_).arg(n_fail_)
+    .arg(total_cycle_ms_ / (n_pass_ + n_fail_)) << Qt::endl;
+}
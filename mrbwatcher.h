@@ -0,0 +1,89 @@
+/*! @file
+  @brief
+  mruby/c irep file writer. (hot-plug watch mode)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+#ifndef MRBWATCHER_H
+#define MRBWATCHER_H
+
+#include <QObject>
+#include <QStringList>
+#include <QTextStream>
+#include <QHash>
+#include <QPair>
+#include <QTimer>
+#include <QElapsedTimer>
+
+#include "mrbsession.h"
+#include "mrbwriter.h"
+#include "mrbdetector.h"
+
+
+//================================================================
+/*! MrbWatcher class.
+
+  Watches the serial ports, and writes every target that is plugged
+  in. A new port is probed until a target answers, and then written
+  by its own session. Several boards are written at once. A port is
+  written once, until it is removed.
+
+  Keeps a tally of the passes, failures and the cycle time.
+  (from the arrival of the port to the end of the session)
+*/
+class MrbWatcher : public QObject
+{
+  Q_OBJECT
+
+public:
+  MrbWatcher( const MrbSessionOption &opt, const QStringList &patterns,
+              const MrbPortFilter &filter, QObject *parent = 0 );
+  void start();
+
+private slots:
+  void poll();
+  void port_found( const QSerialPortInfo &info );
+  void port_not_found( const QSerialPortInfo &info );
+  void job_finished( int id, const MrbWriterResult &r );
+
+private:
+  //! state of a port.
+  enum PortState {
+    PROBING,			//!< waiting for the target to answer.
+    WRITING,			//!< a session is running.
+    DONE,			//!< written, or given up. (until removed)
+  };
+
+  //! a port that is present.
+  struct Port {
+    QString name;		//!< device name.
+    int generation = 0;		//!< arrival number. (a new board at the same location)
+    PortState state = PROBING;
+    bool probing = false;	//!< the detector is probing it now.
+    QElapsedTimer arrived;	//!< time since the port has appeared.
+  };
+
+  QTextStream qout_;		//!< console output stream.
+  MrbSessionOption opt_;	//!< session options and images.
+  QStringList patterns_;	//!< device names to watch. (wildcards. empty: all)
+  MrbPortFilter filter_;	//!< USB device filter.
+  QTimer timer_;		//!< poll interval.
+  MrbDetector detector_;	//!< probes the new ports.
+  MrbWriter writer_;		//!< runs the sessions.
+  QHash<QString, Port> ports_;	//!< present ports, by system location.
+  QHash<int, QPair<QString, int>> jobs_;	//!< system location and generation of the port, by job id.
+  int n_arrivals_;		//!< generation of the last arrival.
+  int n_pass_;			//!< tally: passed boards.
+  int n_fail_;			//!< tally: failed boards.
+  qint64 total_cycle_ms_;	//!< tally: total cycle time.
+
+  bool match( const QSerialPortInfo &info ) const;
+};
+
+#endif
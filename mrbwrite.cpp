@@ -12,7 +12,6 @@
 */
 
 #define APPLICATION_VERSION "1.3.0"
-#define PROTOCOL_VERSION "MRBW1.2"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,17 +19,22 @@
 #include <QCommandLineParser>
 #include <QTextStream>
 #include <QTimer>
+#include <QRegularExpression>
 #include <QSerialPortInfo>
-#include <QSerialPort>
 #include <QFile>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QLocalSocket>
+#include <QFileInfo>
+#include <QElapsedTimer>
 #include <QDebug>
 
 #include "mrbwrite.h"
+#include "rite.h"
 
 #define VERBOSE(s) if( opt_verbose_ ) { qout_ << s << Qt::endl; }
 
-const char * const STR_CANCEL = "\x018";
-
 
 //================================================================
 /*! constructor
@@ -42,7 +46,11 @@ MrbWrite::MrbWrite( int argc, char *argv[] )
   : QCoreApplication( argc, argv ),
     qout_(stdout),
     opt_timeout_(5),
-    serial_baud_rate_(57600)
+    serial_baud_rate_(57600),
+    switch_baud_rate_(0),
+    daemon_(0),
+    scheduler_(0),
+    watcher_(0)
 {
   setApplicationName("mrbwrite");
   setApplicationVersion(APPLICATION_VERSION);
@@ -58,19 +66,93 @@ MrbWrite::MrbWrite( int argc, char *argv[] )
   parser.addPositionalArgument("mrbfile ...", tr("mrb file to write."));
 
   QCommandLineOption lineOption(QStringList() << "l" << "line",
-                                tr("Device name. (e.g. COM1)"), tr("line"));
+                                tr("Device name. (e.g. COM1)\n"
+                                   "Repeat or separate with ',' for several devices, "
+                                   "wildcards are allowed. (e.g. 'ttyUSB*')\n"
+                                   "'auto' for the ports that a target answers."),
+                                tr("line"));
   parser.addOption(lineOption);
 
   QCommandLineOption baudRateOption(QStringList() << "s" << "speed",
                                 tr("Baud rate.(e.g. 57600)"), tr("speed"));
   parser.addOption(baudRateOption);
 
+  QCommandLineOption switchSpeedOption("switch-speed",
+                                tr("Switch to this baud rate after connecting, if the target supports it."),
+                                tr("speed"));
+  parser.addOption(switchSpeedOption);
+
+  QCommandLineOption compressOption("compress",
+                                tr("Send compressed bytecode, if the target supports it."));
+  parser.addOption(compressOption);
+
+  QCommandLineOption forceOption("force",
+                                tr("Rewrite all programs even if they are unchanged on the target."));
+  parser.addOption(forceOption);
+
+  QCommandLineOption statsOption("stats", tr("Show time and throughput of each phase."));
+  parser.addOption(statsOption);
+
+  QCommandLineOption statsJsonOption("stats-json",
+                                tr("Write the statistics to a JSON file."), tr("file"));
+  parser.addOption(statsJsonOption);
+
+  QCommandLineOption verifyOption("verify",
+                                tr("Verify the programs on the target after writing."));
+  parser.addOption(verifyOption);
+
+  QCommandLineOption noExecuteOption("no-execute",
+                                tr("Don't execute the programs after writing."));
+  parser.addOption(noExecuteOption);
+
+  QCommandLineOption noMrbw2Option("no-mrbw2",
+                                tr("Don't use the MRBW2 binary frame mode. (text protocol only)"));
+  parser.addOption(noMrbw2Option);
+
+  QCommandLineOption daemonOption("daemon",
+                                tr("Run as a daemon. Keep the ports open, and run the jobs sent by --client."));
+  parser.addOption(daemonOption);
+
+  QCommandLineOption clientOption("client",
+                                tr("Send the job to the daemon, instead of writing by itself."));
+  parser.addOption(clientOption);
+
+  QCommandLineOption serverNameOption("server-name",
+                                tr("Local socket name of the daemon. (default 'mrbwrite')"),
+                                tr("name"));
+  parser.addOption(serverNameOption);
+
+  QCommandLineOption manifestOption("manifest",
+                                tr("Write the boards listed in a manifest file. (JSON)"),
+                                tr("file"));
+  parser.addOption(manifestOption);
+
+  QCommandLineOption watchOption("watch",
+                                tr("Keep running, and write every target plugged in. (-l or --vid etc. limit the ports)"));
+  parser.addOption(watchOption);
+
   QCommandLineOption verboseOption("verbose", tr("Verbose mode."));
   parser.addOption(verboseOption);
 
   QCommandLineOption showLinesOption("showline", tr("Show all lines."));
   parser.addOption(showLinesOption);
 
+  QCommandLineOption detectOption("detect",
+                                tr("Show the ports that a target answers."));
+  parser.addOption(detectOption);
+
+  QCommandLineOption vidOption("vid",
+                                tr("Detect only the USB devices of this vendor ID. (hex)"), tr("vid"));
+  parser.addOption(vidOption);
+
+  QCommandLineOption pidOption("pid",
+                                tr("Detect only the USB devices of this product ID. (hex)"), tr("pid"));
+  parser.addOption(pidOption);
+
+  QCommandLineOption serialOption("serial",
+                                tr("Detect only the USB device of this serial number."), tr("serial"));
+  parser.addOption(serialOption);
+
   QCommandLineOption timeoutOption("timeout",
 				   tr("Command timeout."), tr("timeout"));
   parser.addOption(timeoutOption);
@@ -78,12 +160,38 @@ MrbWrite::MrbWrite( int argc, char *argv[] )
   parser.process(*this);
 
   mrb_files_ = parser.positionalArguments();
-  line_ = parser.value( lineOption );
+  foreach( const QString &s, parser.values( lineOption )) {
+    lines_ << s.split(',', Qt::SkipEmptyParts);
+  }
   if( parser.isSet( baudRateOption ) ) {
     serial_baud_rate_ = parser.value( baudRateOption ).toInt();
   }
+  if( parser.isSet( switchSpeedOption ) ) {
+    switch_baud_rate_ = parser.value( switchSpeedOption ).toInt();
+  }
+  opt_compress_ = parser.isSet(compressOption);
+  opt_force_ = parser.isSet(forceOption);
+  opt_stats_ = parser.isSet(statsOption);
+  opt_stats_json_ = parser.value( statsJsonOption );
+  opt_execute_ = !parser.isSet(noExecuteOption);
+  opt_verify_ = parser.isSet(verifyOption);
+  opt_mrbw2_ = !parser.isSet(noMrbw2Option);
+  opt_daemon_ = parser.isSet(daemonOption);
+  opt_client_ = parser.isSet(clientOption);
+  opt_server_name_ = parser.isSet( serverNameOption ) ?
+    parser.value( serverNameOption ) : QString("mrbwrite");
+  opt_manifest_ = parser.value( manifestOption );
+  opt_watch_ = parser.isSet(watchOption);
   opt_verbose_ = parser.isSet(verboseOption);
   opt_show_lines_ = parser.isSet(showLinesOption);
+  opt_detect_ = parser.isSet(detectOption);
+  if( parser.isSet( vidOption ) ) {
+    opt_filter_.vid = parser.value( vidOption ).toInt( 0, 16 );
+  }
+  if( parser.isSet( pidOption ) ) {
+    opt_filter_.pid = parser.value( pidOption ).toInt( 0, 16 );
+  }
+  opt_filter_.serial = parser.value( serialOption );
   if( parser.isSet( timeoutOption ) ) {
     opt_timeout_ = parser.value( timeoutOption ).toInt();
   }
@@ -111,10 +219,49 @@ void MrbWrite::run()
     goto DONE;
   }
 
+  /*
+    process --detect option.
+  */
+  if( opt_detect_ ) {
+    flag_error = show_detected();
+    goto DONE;
+  }
+
+  /*
+    the USB device filter alone means '-l auto'.
+  */
+  if( lines_.isEmpty() && !opt_filter_.is_empty() ) lines_ << "auto";
+
+  /*
+    daemon mode. keep running until killed.
+  */
+  if( opt_daemon_ ) {
+    lines_ = expand_lines( lines_ );
+    if( lines_.isEmpty() ) {
+      qout_ << tr("must specify line (-l option)") << Qt::endl;
+      goto DONE;
+    }
+    daemon_ = new MrbDaemon( opt_server_name_, lines_, session_option(), this );
+    if( !daemon_->start() ) goto DONE;
+    return;
+  }
+
+  /*
+    manifest mode. the manifest gives the lines and files.
+  */
+  if( !opt_manifest_.isEmpty() ) {
+    scheduler_ = new MrbScheduler( session_option(), this );
+    connect( scheduler_, &MrbScheduler::finished, this, &MrbWrite::scheduler_finished );
+    if( !scheduler_->load( opt_manifest_ )) goto DONE;
+    if( !scheduler_->start() ) goto DONE;
+    return;	// continue at scheduler_finished()
+  }
+
   /*
     check --line option is specified.
+    (the client may leave it to the daemon, and the watch mode watches all ports)
   */
-  if( line_.isEmpty() ) {
+  if( lines_.isEmpty() && !opt_client_ && !opt_watch_ ) {
     qout_ << tr("must specify line (-l option)") << Qt::endl;
     goto DONE;
   }
@@ -137,333 +284,346 @@ void MrbWrite::run()
   if( flag_error ) goto DONE;
 
   /*
-    connect target
+    load and validate all .mrb files before opening any port.
+    (memory mapped, and shared by all sessions)
   */
-  if( connect_target() != 0 ) goto DONE;
+  foreach( const QString &filename, mrb_files_ ) {
+    MrbImage image;
+    RiteInfo rite;
+    QString error;
+    if( !image.load( filename )) {
+      qout_ << image.error_string() << Qt::endl;
+      flag_error = 1;
+    } else if( !rite_parse( image.data(), &rite, &error )) {
+      qout_ << tr("Invalid mrb file '%1'. %2").arg(filename).arg(error) << Qt::endl;
+      flag_error = 1;
+    } else {
+      VERBOSE( tr("'%1' %2 %3 bytes, %4 sections.").arg(filename)
+               .arg(QString(rite.version)).arg(rite.size).arg(rite.sections.size()) );
+    }
+    images_ << image;
+  }
+  if( flag_error ) goto DONE;
 
   /*
-    clear existed bytecode.
+    client mode. the daemon does the rest.
   */
-  flag_error = clear_bytecode();
-  if( flag_error && !target_rite_version_.isEmpty() ) goto DONE;
+  if( opt_client_ ) {
+    lines_ = expand_lines( lines_ );
+    flag_error = run_client();
+    goto DONE;
+  }
 
   /*
-    open .mrb files and write target.
+    watch mode. keep running until killed.
+    (-l gives the names to watch, not the ports now present)
   */
-  foreach( const QString filename, mrb_files_ ) {
-    QFile file( filename );
-    if( !file.open( QIODevice::ReadOnly ) ) {
-      qout_ << tr("Can't open file '%1'.").arg(filename) << Qt::endl;
-      goto DONE;
-    }
-
-    qout_ << tr("Writing %1").arg(filename) << Qt::endl;
-    flag_error = write_file( file );
-    file.close();
-
-    if( flag_error ) goto DONE;
+  if( opt_watch_ ) {
+    watcher_ = new MrbWatcher( session_option(), lines_, opt_filter_, this );
+    watcher_->start();
+    return;
   }
 
-  /*
-    display program list
-   */
-  show_prog();
+  lines_ = expand_lines( lines_ );
+  if( lines_.isEmpty() ) {
+    qout_ << tr("No device matches the -l option.") << Qt::endl;
+    flag_error = 1;
+    goto DONE;
+  }
 
   /*
-    execute program
+    start a job for each line.
+    each job runs in its own thread, so all boards are written concurrently.
   */
-  execute_program();
+  {
+    MrbSessionOption opt = session_option();
+
+    connect( &writer_, &MrbWriter::finished, this, &MrbWrite::session_finished );
+    foreach( const QString &line, lines_ ) {
+      QString prefix = (lines_.size() > 1) ? QString("[%1] ").arg(line) : QString();
+      jobs_ << writer_.start( line, opt, prefix );
+    }
+  }
+  return;	// continue at session_finished()
 
   /*
     finalizer
   */
  DONE:
-  if( serial_port_.isOpen() ) {
-    VERBOSE( tr("Closing serial port."));
-    serial_port_.close();
-  }
   VERBOSE( tr("Program end"));
   exit( flag_error );
 }
 
 
 //================================================================
-/*! connect target board.
+/*! a session has finished.
 
-  @retval    int
+  @param	id	job id.
+  @param	r	result of the session.
 */
-int MrbWrite::connect_target()
+void MrbWrite::session_finished( int id, const MrbWriterResult &r )
 {
-  int n_try = 0;
-  int i, ret;
-
-  qout_ << tr("Start connection.") << Qt::endl;
-
- REDO:
-  if( ++n_try > 10 ) {
-    qout_ << tr("Try over 10 times.") << Qt::endl;
-    return 1;
-  }
-
-  // trying to open serial port.
-  VERBOSE( tr("Trying to open '%1'.").arg(line_) );
-  for( i = 0; i < 50; i++ ) {
-    ret = setup_serial_port();
-    if( ret != 1 ) break;
-    sleep_ms( 100 );
-  }
-  switch( ret ) {
-  case 1:
-    qout_ << tr("Can't open serial port line.") << Qt::endl;
-    return 1;
-  case 2:
-    qout_ << tr("Can't set baud rate.") << Qt::endl;
-    return 1;
-  }
-  VERBOSE("Serial port is ready.");
-
-  // trying to connect target
-  VERBOSE("Trying to connect target.");
-  const int MAX_CONN = 10;
-  for( i = 0; i < MAX_CONN; i++ ) {
-    if( serial_port_.error() != QSerialPort::NoError ) {
-      VERBOSE("Serial port error has detected. Retrying.");
-      serial_port_.close();
-      sleep_ms( 100 );
-      goto REDO;
-    }
-    sleep_ms( 100 );
-    serial_port_.clear();
-    serial_port_.write("\r\n");
-    serial_port_.flush();
-    VERBOSE("\n==> '\\r\\n' to target for connection start.");
-    qout_ << ".";
-    qout_.flush();
-
-    QString r = get_line(50);
-    VERBOSE(tr("<== '%1'").arg(r.trimmed()));
-    if( r.startsWith("+OK mruby/c") ) break;
-  }
-  qout_ << "\r                 \r";
-  if( i == MAX_CONN ) {
-    qout_ << tr("Can't connect target device.") << Qt::endl;
-    return 1;
-  }
-  qout_ << tr("OK.") << Qt::endl;
-  sleep_ms( 100 );
-  serial_port_.clear();
-
-  // check target version
-  VERBOSE(tr("Check target version."));
-  serial_port_.write("version\r\n");
-  VERBOSE(tr("==> 'version'"));
-
-  QString target_version = get_line().trimmed();
-  VERBOSE(tr("<== '%1'").arg(target_version));
-
-  // (for backword compatibility)
-  if( target_version.startsWith("+OK mruby/c PSoC_5LP v1.00 ") ||
-      target_version.startsWith("+OK mruby/c v2.1")) {
-    ret = 0;
-  } else {
-    QStringList vers = target_version.split(' ');
-    target_rite_version_ = vers[3];
-    ret = (vers[4] != PROTOCOL_VERSION);
-  }
+  results_.insert( id, r );
+  if( results_.size() < jobs_.size() ) return;
 
-  if( ret ) {
-    qout_ << tr("protocol version mismatch.") << Qt::endl;
-  } else {
-    VERBOSE(tr("Target firmware version OK."));
+  int flag_error = 0;
+  foreach( const MrbWriterResult &res, results_ ) {
+    if( res.result != 0 ) flag_error = 1;
   }
+  if( jobs_.size() > 1 ) show_summary();
+  if( opt_stats_ ) show_stats();
+  if( !opt_stats_json_.isEmpty() && write_stats_json() != 0 ) flag_error = 1;
 
-  return ret;
+  VERBOSE( tr("Program end"));
+  exit( flag_error );
 }
 
 
 //================================================================
-/*! clear existed mruby/c bytecode.
+/*! the manifest scheduler has finished.
+
+  @param	result	0: all boards are written.
 */
-int MrbWrite::clear_bytecode()
+void MrbWrite::scheduler_finished( int result )
 {
-  qout_ << tr("Clear existed bytecode.") << Qt::endl;
-
-  if( chat("clear") < 0 ) {
-    qout_ << tr("Bytecode clear error.") << Qt::endl;
-    return 1;
-  }
-  VERBOSE("Clear bytecode OK.");
-  return 0;
+  VERBOSE( tr("Program end"));
+  exit( result );
 }
 
 
 //================================================================
-/*! show program list
+/*! session options from the command line options.
+
 */
-int MrbWrite::show_prog()
+MrbSessionOption MrbWrite::session_option() const
 {
-  serial_port_.write("showprog\r\n");
-  VERBOSE(tr("==> 'showprog'"));
-
-  QString r;
-
-  while( 1 ) {
-    r = get_line();
-    if( r.startsWith("+DONE")) break;
-    if( r.startsWith( STR_CANCEL )) break;
-    qout_ << r;
-  }
-  VERBOSE(tr("<== '%1'").arg(r.trimmed()));
-
-  return 0;
+  MrbSessionOption opt;
+  opt.verbose = opt_verbose_;
+  opt.timeout = opt_timeout_;
+  opt.baud_rate = serial_baud_rate_;
+  opt.switch_baud_rate = switch_baud_rate_;
+  opt.compress = opt_compress_;
+  opt.force = opt_force_;
+  opt.execute = opt_execute_;
+  opt.verify = opt_verify_;
+  opt.mrbw2 = opt_mrbw2_;
+  opt.images = images_;
+
+  return opt;
 }
 
 
 //================================================================
-/*! write a file.
+/*! send the job to the daemon, and show the results. (--client)
 
-  @param	file	file I/O object.
   @retval	int	0: no error
 */
-int MrbWrite::write_file( QIODevice &file )
+int MrbWrite::run_client()
 {
-  int filesize = file.size();
-  QByteArray header = file.read(8);
-
-  // check RITE version.
-  if( !target_rite_version_.isEmpty() ) {
-    if( target_rite_version_ != header ) {
-      qout_ << "mrb file RITE version mismatch." << Qt::endl;
-      return 2;
-    }
-    VERBOSE(tr("RITE version '%1' check OK.").arg(target_rite_version_));
-  }
-
-  // send "write" command
-  QString s = QString("write %1").arg( filesize );
-  if( chat(s.toLocal8Bit()) < 0 ) {
-    qout_ << "command error." << Qt::endl;
+  QLocalSocket socket;
+  socket.connectToServer( opt_server_name_ );
+  if( !socket.waitForConnected( 3000 )) {
+    qout_ << tr("Can't connect to the daemon '%1'. %2")
+      .arg(opt_server_name_).arg(socket.errorString()) << Qt::endl;
     return 1;
   }
 
-  // send mrb file.
-  serial_port_.write( header );
+  QStringList files;
+  foreach( const QString &filename, mrb_files_ ) {
+    files << QFileInfo( filename ).absoluteFilePath();
+  }
+  QJsonObject req;
+  req["lines"] = QJsonArray::fromStringList( lines_ );
+  req["files"] = QJsonArray::fromStringList( files );
+  req["force"] = opt_force_;
+  req["compress"] = opt_compress_;
+  req["execute"] = opt_execute_;
+  req["verify"] = opt_verify_;
+  socket.write( QJsonDocument( req ).toJson( QJsonDocument::Compact ) + "\n" );
+  VERBOSE( tr("Sent the job to '%1'.").arg(opt_server_name_));
+
+  // show the result of each port, until "done".
+  while( 1 ) {
+    while( !socket.canReadLine() ) {
+      if( !socket.waitForReadyRead( -1 )) {
+        qout_ << tr("Lost the daemon.") << Qt::endl;
+        return 1;
+      }
+    }
 
-  for( int i = 0; i < filesize-8; i++ ) {
-    char ch;
-    file.getChar(&ch);
-    serial_port_.putChar(ch);
-    serial_port_.waitForBytesWritten();
+    QJsonObject r = QJsonDocument::fromJson( socket.readLine() ).object();
+    if( r.contains("log") ) qout_ << r["log"].toString();
+    if( r["done"].toBool() ) {
+      if( r.contains("error") ) qout_ << r["error"].toString() << Qt::endl;
+      return r["result"].toInt( 1 );
+    }
   }
-  VERBOSE(tr("Send %1 bytes done.").arg(filesize));
+}
+
 
-  // check status.
-  while(1) {
-    QString r = get_line();
-    VERBOSE(tr("<== '%1'").arg(r.trimmed()));
+//================================================================
+/*! expand device names.
 
-    if( r.startsWith( STR_CANCEL )) {
-      qout_ << tr("transfer timeout") << Qt::endl;
-      return 1;
+  @param	lines	device names given by -l option.
+  @return	device names. (wildcards resolved, duplicates removed)
+*/
+QStringList MrbWrite::expand_lines( const QStringList &lines )
+{
+  QStringList ret;
+  const QList<QSerialPortInfo> ports = QSerialPortInfo::availablePorts();
+
+  foreach( const QString &line, lines ) {
+    if( line == "auto" ) {
+      foreach( const QString &name, detect_lines() ) {
+        if( !ret.contains( name )) ret << name;
+      }
+      continue;
+    }
+    if( !line.contains('*') && !line.contains('?') ) {
+      if( !ret.contains( line )) ret << line;
+      continue;
     }
-    if( r.startsWith("+DONE")) break;
-    if( r.startsWith("-ERR")) {
-      qout_ << tr("transfer error. '%1'").arg(r.trimmed()) << Qt::endl;
-      return 1;
+
+    QRegularExpression re( QRegularExpression::wildcardToRegularExpression( line ));
+    foreach( const QSerialPortInfo &info, ports ) {
+      QString name;
+      if( re.match( info.portName() ).hasMatch() ) {
+        name = info.portName();
+      } else if( re.match( info.systemLocation() ).hasMatch() ) {
+        name = info.systemLocation();
+      } else {
+        continue;
+      }
+      if( !ret.contains( name )) ret << name;
     }
-    qout_ << r << Qt::endl;
   }
 
-  qout_ << tr("OK.") << Qt::endl;
-  return 0;
+  return ret;
 }
 
 
 //================================================================
-/*! execute program
+/*! show per-port result summary.
 
 */
-void MrbWrite::execute_program()
+void MrbWrite::show_summary()
 {
-  qout_ << tr("Start mruby/c program.") << Qt::endl;
-
-  if( chat("execute") >= 0 ) {
-    qout_ << tr("OK.") << Qt::endl;
-  } else {
-    qout_ << tr("execute error.") << Qt::endl;
+  qout_ << Qt::endl << tr("Summary:") << Qt::endl;
+  foreach( const MrbWriterResult &r, results_ ) {
+    qout_ << QString("  %1 %2 %3 ms")
+      .arg( r.line, -16 )
+      .arg( QString( r.result == 0 ? "OK" : "ERROR" ), -6 )
+      .arg( r.elapsed_ms, 6 ) << Qt::endl;
   }
 }
 
 
 //================================================================
-/*! open a communication port.
+/*! show the statistics of each session. (--stats)
 
-  @retval	int	0: no error
 */
-int MrbWrite::setup_serial_port()
+void MrbWrite::show_stats()
 {
-  serial_port_.setPortName( line_ );
-
-  if( !serial_port_.open( QIODevice::ReadWrite )) return 1;
-  if( !serial_port_.setBaudRate( serial_baud_rate_ )) return 2;
-
-  serial_port_.setDataBits( QSerialPort::Data8 );
-  serial_port_.setParity( QSerialPort::NoParity );
-  serial_port_.setStopBits( QSerialPort::OneStop );
-  serial_port_.setFlowControl( QSerialPort::HardwareControl );
+  foreach( const MrbWriterResult &r, results_ ) {
+    const MrbSessionStats &st = r.stats;
+    qint64 total_bytes = 0;
+
+    qout_ << Qt::endl << tr("Statistics: %1").arg(r.line) << Qt::endl;
+    qout_ << QString("  %1 %2 %3 %4").arg("phase", -28)
+      .arg("ms", 8).arg("bytes", 8).arg("bytes/s", 8) << Qt::endl;
+    foreach( const MrbSessionPhase &phase, st.phases ) {
+      QString s = QString("  %1 %2").arg(phase.name, -28).arg(phase.ms, 8);
+      if( phase.bytes > 0 ) {
+        s += QString(" %1 %2").arg(phase.bytes, 8)
+          .arg(phase.bytes * 1000 / qMax<qint64>( phase.ms, 1 ), 8);
+      }
+      qout_ << s << Qt::endl;
+      total_bytes += phase.bytes;
+    }
+    qout_ << QString("  %1 %2 %3").arg("total", -28)
+      .arg(r.elapsed_ms, 8).arg(total_bytes, 8) << Qt::endl;
 
-  return 0;
+    qint64 rtt_avg_us = st.n_commands ? st.rtt_total_us / st.n_commands : 0;
+    qout_ << tr("  commands %1, rtt avg %2 ms, max %3 ms, probes %4, retries %5, timeouts %6")
+      .arg(st.n_commands).arg(rtt_avg_us / 1000.0, 0, 'f', 1).arg(st.rtt_max_us / 1000.0, 0, 'f', 1)
+      .arg(st.n_probes).arg(st.n_retries).arg(st.n_timeouts) << Qt::endl;
+  }
 }
 
 
 //================================================================
-/*! get a line from serial port with timeout.
+/*! write the statistics of each session to a JSON file. (--stats-json)
 
-  @param	timeout_count	timeout counter.
-  @return QString
+  @retval	int	0: no error
 */
-QString MrbWrite::get_line( int timeout_count )
+int MrbWrite::write_stats_json()
 {
-  if( timeout_count == 0 ) {
-    timeout_count = opt_timeout_ * 100;
+  QJsonArray sessions;
+
+  foreach( const MrbWriterResult &r, results_ ) {
+    const MrbSessionStats &st = r.stats;
+    QJsonArray phases;
+    foreach( const MrbSessionPhase &phase, st.phases ) {
+      QJsonObject ph;
+      ph["name"] = phase.name;
+      ph["ms"] = phase.ms;
+      ph["bytes"] = phase.bytes;
+      ph["bytes_per_sec"] = phase.bytes * 1000 / qMax<qint64>( phase.ms, 1 );
+      phases.append( ph );
+    }
+
+    QJsonObject obj;
+    obj["line"] = r.line;
+    obj["result"] = r.result;
+    obj["total_ms"] = r.elapsed_ms;
+    obj["handshake_ms"] = st.connect_ms;
+    obj["commands"] = st.n_commands;
+    obj["rtt_avg_us"] = st.n_commands ? st.rtt_total_us / st.n_commands : 0;
+    obj["rtt_max_us"] = st.rtt_max_us;
+    obj["bytes_sent"] = st.bytes_sent;
+    obj["transfer_ms"] = st.transfer_ms;
+    obj["bytes_per_sec"] = st.bytes_sent * 1000 / qMax<qint64>( st.transfer_ms, 1 );
+    obj["probes"] = st.n_probes;
+    obj["retries"] = st.n_retries;
+    obj["timeouts"] = st.n_timeouts;
+    obj["phases"] = phases;
+    sessions.append( obj );
   }
 
-  for( int i = 0; i < timeout_count; i++ ) {
-    if( serial_port_.canReadLine()) {
-      return serial_port_.readLine();
-    }
-    sleep_ms(10);
+  QJsonObject root;
+  root["version"] = APPLICATION_VERSION;
+  root["sessions"] = sessions;
+
+  QFile file( opt_stats_json_ );
+  if( !file.open( QIODevice::WriteOnly | QIODevice::Truncate )) {
+    qout_ << tr("Can't write '%1'.").arg(opt_stats_json_) << Qt::endl;
+    return 1;
   }
+  file.write( QJsonDocument( root ).toJson() );
 
-  return QString(STR_CANCEL);	// Timeout
+  return 0;
 }
 
 
 //================================================================
-/*! chat
+/*! a line of the device list.
 
-  @param cmd    send command.
-  @return int   0=+OK, 1=+DONE, -1=-ERR, -2=Timeout
+  @param	info	port.
+  @return	name, description, manufacturer, and USB IDs if any.
 */
-int MrbWrite::chat( const char *cmd )
+static QString port_info_string( const QSerialPortInfo &info )
 {
-  VERBOSE(tr("==> '%1'").arg(cmd));
-
-  serial_port_.write(cmd);
-  serial_port_.write("\r\n");
-
-  while( 1 ) {
-    QString r = get_line();
-    VERBOSE(tr("<== '%1'").arg(r.trimmed()));
-    if( r.startsWith("+OK")) return 0;
-    if( r.startsWith("+DONE")) return 1;
-    if( r.startsWith("-ERR")) return -1;
-    if( r.startsWith( STR_CANCEL )) {
-      qout_ << "TIMEOUT!" << Qt::endl;
-      return -2;
-    }
-    qout_ << r;
+  QString s = QString("%1\t%2\t%3")
+    .arg(info.portName())
+    .arg(info.description())
+    .arg(info.manufacturer());
+  if( info.hasVendorIdentifier() && info.hasProductIdentifier() ) {
+    s += QString("\t%1:%2\t%3")
+      .arg(info.vendorIdentifier(), 4, 16, QChar('0'))
+      .arg(info.productIdentifier(), 4, 16, QChar('0'))
+      .arg(info.serialNumber());
   }
+  return s;
 }
 
 
@@ -474,22 +634,57 @@ int MrbWrite::chat( const char *cmd )
 void MrbWrite::show_lines()
 {
   foreach( const QSerialPortInfo &info, QSerialPortInfo::availablePorts() ) {
-    QString s = QString("%1\t%2\t%3")
-      .arg(info.portName())
-      .arg(info.description())
-      .arg(info.manufacturer());
-    qout_ << s << Qt::endl;
+    qout_ << port_info_string( info ) << Qt::endl;
   }
 }
 
 
 //================================================================
-/*! sleep (ms)
+/*! show the ports that a target answers. (--detect)
 
+  @retval	int	0: found one or more.
 */
-void MrbWrite::sleep_ms( int ms )
+int MrbWrite::show_detected()
 {
-  QEventLoop loop;
-  QTimer::singleShot( ms, &loop, SLOT(quit()) );
-  loop.exec();
+  QElapsedTimer timer;
+  timer.start();
+  QList<QSerialPortInfo> candidates = MrbDetector::candidates( opt_filter_ );
+
+  MrbDetector detector;
+  detector.set_baud_rate( serial_baud_rate_ );
+  QList<QSerialPortInfo> found = detector.detect( candidates );
+
+  foreach( const QSerialPortInfo &info, found ) {
+    qout_ << port_info_string( info ) << Qt::endl;
+  }
+  VERBOSE( tr("%1 of %2 port(s) answered. (%3 ms)")
+           .arg(found.size()).arg(candidates.size()).arg(timer.elapsed()) );
+
+  return found.isEmpty() ? 1 : 0;
+}
+
+
+//================================================================
+/*! ports that a target answers. (-l auto)
+
+  All candidate ports are probed at once.
+
+  @return	device names.
+*/
+QStringList MrbWrite::detect_lines()
+{
+  QElapsedTimer timer;
+  timer.start();
+  QList<QSerialPortInfo> candidates = MrbDetector::candidates( opt_filter_ );
+
+  MrbDetector detector;
+  detector.set_baud_rate( serial_baud_rate_ );
+  QStringList ret;
+  foreach( const QSerialPortInfo &info, detector.detect( candidates )) {
+    ret << info.portName();
+  }
+
+  VERBOSE( tr("Detected %1 of %2 port(s). (%3 ms) %4")
+           .arg(ret.size()).arg(candidates.size()).arg(timer.elapsed()).arg(ret.join(' ')) );
+  return ret;
 }
@@ -13,8 +13,15 @@
 #include <QCoreApplication>
 #include <QStringList>
 #include <QTextStream>
-#include <QSerialPort>
-#include <QIODevice>
+#include <QList>
+#include <QMap>
+
+#include "mrbsession.h"
+#include "mrbwriter.h"
+#include "mrbdetector.h"
+#include "mrbdaemon.h"
+#include "mrbscheduler.h"
+#include "mrbwatcher.h"
 
 
 //================================================================
@@ -26,29 +33,52 @@ class MrbWrite : public QCoreApplication
 
 public:
   MrbWrite( int argc, char *argv[] );
-  void sleep_ms( int ms );
 
 public slots:
   void run();
 
+private slots:
+  void session_finished( int id, const MrbWriterResult &r );
+  void scheduler_finished( int result );
+
 private:
   QTextStream qout_;		//!< console output stream.
   bool opt_verbose_;		//!< command line option --verbose
   bool opt_show_lines_;		//!< command line option --showline
+  bool opt_detect_;		//!< command line option --detect
+  MrbPortFilter opt_filter_;	//!< command line option --vid, --pid, --serial
   int opt_timeout_;		//!< command line option --timeout
-  QString line_;		//!< command line option parameter -l
+  bool opt_compress_;		//!< command line option --compress
+  bool opt_force_;		//!< command line option --force
+  bool opt_stats_;		//!< command line option --stats
+  QString opt_stats_json_;	//!< command line option --stats-json
+  bool opt_execute_;		//!< command line option --no-execute (inverted)
+  bool opt_verify_;		//!< command line option --verify
+  bool opt_mrbw2_;		//!< command line option --no-mrbw2 (inverted)
+  bool opt_daemon_;		//!< command line option --daemon
+  bool opt_client_;		//!< command line option --client
+  QString opt_server_name_;	//!< command line option --server-name
+  QString opt_manifest_;	//!< command line option --manifest
+  bool opt_watch_;		//!< command line option --watch
+  QStringList lines_;		//!< command line option parameter -l
   QStringList mrb_files_;	//!< .mrb file filename list.
-  QSerialPort serial_port_;	//!< serial port object.
+  QList<MrbImage> images_;	//!< loaded .mrb files.
   int serial_baud_rate_;	//!< serial baud rate.
-  QString target_rite_version_;	//!< target board RITE version string.
-
-  int connect_target();
-  int clear_bytecode();
-  int show_prog();
-  int write_file( QIODevice &file );
-  void execute_program();
-  int setup_serial_port();
-  QString get_line( int timeout_count = 0 );
-  int chat( const char * );
+  int switch_baud_rate_;	//!< command line option --switch-speed
+  MrbWriter writer_;		//!< runs the sessions.
+  QList<int> jobs_;		//!< job ids, in the order of lines_.
+  QMap<int, MrbWriterResult> results_; //!< results of the finished jobs, by job id.
+  MrbDaemon *daemon_;		//!< daemon. (--daemon)
+  MrbScheduler *scheduler_;	//!< manifest scheduler. (--manifest)
+  MrbWatcher *watcher_;		//!< hot-plug watcher. (--watch)
+
+  MrbSessionOption session_option() const;
+  int run_client();
+  QStringList expand_lines( const QStringList &lines );
+  void show_summary();
+  void show_stats();
+  int write_stats_json();
   void show_lines();
+  int show_detected();
+  QStringList detect_lines();
 };
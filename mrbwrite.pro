@@ -14,13 +14,14 @@ INCLUDEPATH += .
 #DEFINES += QT_DISABLE_DEPRECATED_UP_TO=0x060000 # disables all APIs deprecated in Qt 6.0.0 and earlier
 
 # Input
-HEADERS += mrbwrite.h
-SOURCES += main.cpp mrbwrite.cpp
+HEADERS += mrbwrite.h mrbdaemon.h mrbscheduler.h mrbwatcher.h
+SOURCES += main.cpp mrbwrite.cpp mrbdaemon.cpp mrbscheduler.cpp mrbwatcher.cpp
+include(mrbwritelib.pri)
 
 
 #add
 QT -= gui
-QT += serialport
+QT += serialport network
 CONFIG -= app_bundle
 CONFIG += console
 
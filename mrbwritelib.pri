@@ -0,0 +1,15 @@
+######################################################################
+# mrbwrite library. (protocol engine, without the command line)
+#
+# include this file to build the sources into an application,
+# or link the static library built by lib/mrbwritelib.pro.
+######################################################################
+
+INCLUDEPATH += $$PWD
+
+HEADERS += $$PWD/mrbwriter.h $$PWD/mrbsession.h $$PWD/mrbdetector.h $$PWD/mrbimage.h \
+           $$PWD/rite.h $$PWD/lzss.h $$PWD/crc32.h
+SOURCES += $$PWD/mrbwriter.cpp $$PWD/mrbsession.cpp $$PWD/mrbdetector.cpp $$PWD/mrbimage.cpp \
+           $$PWD/rite.cpp $$PWD/lzss.cpp $$PWD/crc32.cpp
+
+QT += serialport
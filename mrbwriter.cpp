@@ -0,0 +1,136 @@
+/*! @file
+  @brief
+  mruby/c irep file writer. (asynchronous writer library)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+
+#include <QThread>
+#include <QEventLoop>
+#include <QTimer>
+
+#include "mrbwriter.h"
+
+
+//================================================================
+/*! constructor
+
+  @param	parent	parent object.
+*/
+MrbWriter::MrbWriter( QObject *parent )
+  : QObject( parent ),
+    next_id_(0)
+{
+  qRegisterMetaType<MrbWriterResult>();
+}
+
+
+//================================================================
+/*! destructor
+
+  Waits for the running jobs. (a session can't be interrupted)
+*/
+MrbWriter::~MrbWriter()
+{
+  foreach( const Job &job, jobs_ ) {
+    job.thread->wait();
+    delete job.session;
+  }
+}
+
+
+//================================================================
+/*! start a job. returns at once.
+
+  connect target, clear, write all files and execute, as given by opt.
+  finished() is emitted at the end.
+
+  @param	line	device name.
+  @param	opt	session options.
+  @param	prefix	output line prefix. (e.g. "[COM3] ")
+  @return	job id.
+*/
+int MrbWriter::start( const QString &line, const MrbSessionOption &opt,
+                      const QString &prefix )
+{
+  int id = next_id_++;
+  Job job;
+  job.session = new MrbSession( line, opt );
+  if( !prefix.isEmpty() ) job.session->set_prefix( prefix );
+  job.thread = new QThread( this );
+  job.session->moveToThread( job.thread );
+
+  connect( job.thread, &QThread::started, job.session, &MrbSession::run );
+  connect( job.session, &MrbSession::finished, job.thread, &QThread::quit );
+  connect( job.thread, &QThread::finished, this, &MrbWriter::thread_finished );
+  connect( job.session, &MrbSession::phase_finished, this,
+           [this, id]( const QString &name, qint64 ms ) {
+             emit phase_finished( id, name, ms );
+           });
+  connect( job.session, &MrbSession::progress, this,
+           [this, id]( qint64 bytes, qint64 total ) {
+             emit progress( id, bytes, total );
+           });
+
+  jobs_.insert( id, job );
+  job.thread->start();
+
+  return id;
+}
+
+
+//================================================================
+/*! wait for all jobs, running the event loop.
+
+  For the callers that have no event loop of their own. (e.g. tests)
+
+  @param	timeout_ms	timeout. (-1: forever)
+  @retval	bool		true: all jobs have finished.
+*/
+bool MrbWriter::wait( int timeout_ms )
+{
+  if( jobs_.isEmpty() ) return true;
+
+  QEventLoop loop;
+  connect( this, &MrbWriter::all_finished, &loop, &QEventLoop::quit );
+  if( timeout_ms >= 0 ) QTimer::singleShot( timeout_ms, &loop, &QEventLoop::quit );
+  loop.exec();
+
+  return jobs_.isEmpty();
+}
+
+
+//================================================================
+/*! a session thread has finished.
+*/
+void MrbWriter::thread_finished()
+{
+  QThread *thread = qobject_cast<QThread *>(sender());
+  int id = -1;
+  for( auto it = jobs_.cbegin(); it != jobs_.cend(); ++it ) {
+    if( it.value().thread == thread ) id = it.key();
+  }
+  if( id < 0 ) return;
+  thread->wait();
+
+  Job job = jobs_.take( id );
+  MrbWriterResult r;
+  r.id = id;
+  r.line = job.session->line();
+  r.result = job.session->result();
+  r.elapsed_ms = job.session->elapsed_ms();
+  r.stats = job.session->stats();
+  r.log = job.session->take_log();
+
+  delete job.session;
+  thread->deleteLater();
+
+  emit finished( id, r );
+  if( jobs_.isEmpty() ) emit all_finished();
+}
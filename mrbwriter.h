@@ -0,0 +1,85 @@
+/*! @file
+  @brief
+  mruby/c irep file writer. (asynchronous writer library)
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+#ifndef MRBWRITER_H
+#define MRBWRITER_H
+
+#include <QObject>
+#include <QString>
+#include <QMap>
+#include <QMetaType>
+
+#include "mrbsession.h"
+
+class QThread;
+
+
+//================================================================
+/*! MrbWriter job result.
+*/
+struct MrbWriterResult {
+  int id = -1;			//!< job id.
+  QString line;			//!< device name.
+  int result = -1;		//!< 0: no error
+  qint64 elapsed_ms = 0;	//!< session time (ms).
+  MrbSessionStats stats;	//!< statistics.
+  QString log;			//!< output. (capture or quiet option)
+};
+Q_DECLARE_METATYPE(MrbWriterResult)
+
+
+//================================================================
+/*! MrbWriter class.
+
+  Runs write jobs without blocking the caller. Each job is one
+  MrbSession in its own thread, so many jobs can run at once in one
+  process. The signals are emitted in the thread of the MrbWriter.
+
+    MrbWriter writer;
+    connect( &writer, &MrbWriter::finished, ... );
+    int id = writer.start( "COM3", opt );
+*/
+class MrbWriter : public QObject
+{
+  Q_OBJECT
+
+public:
+  explicit MrbWriter( QObject *parent = 0 );
+  ~MrbWriter();
+
+  int start( const QString &line, const MrbSessionOption &opt,
+             const QString &prefix = QString() );
+  bool is_running( int id ) const { return jobs_.contains( id ); }
+  int n_running() const { return jobs_.size(); }
+  bool wait( int timeout_ms = -1 );
+
+signals:
+  void phase_finished( int id, const QString &name, qint64 ms );
+  void progress( int id, qint64 bytes, qint64 total );
+  void finished( int id, const MrbWriterResult &result );
+  void all_finished();
+
+private slots:
+  void thread_finished();
+
+private:
+  //! a running job.
+  struct Job {
+    MrbSession *session = 0;
+    QThread *thread = 0;
+  };
+
+  int next_id_;			//!< id of the next job.
+  QMap<int, Job> jobs_;		//!< running jobs.
+};
+
+#endif
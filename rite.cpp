@@ -0,0 +1,122 @@
+/*! @file
+  @brief
+  RITE (.mrb) file header and section parser.
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+
+  File layout: (multi-byte values are big endian)
+    header   "RITE" version(4) size(4) compiler(4) compiler version(4)
+             (mruby 1.x and 2.x, version "00xx", have crc(2) before the size)
+    sections ident(4) size(4) body ...
+             the last section is "END\0" with size 8.
+*/
+
+#include <string.h>
+#include <QCoreApplication>
+#include <QtEndian>
+
+#include "rite.h"
+
+static const int RITE_HEADER_SIZE = 20;
+static const int RITE_HEADER_SIZE_V0 = 22;	//!< version "00xx". (with CRC)
+static const int SECTION_HEADER_SIZE = 8;
+
+#define TR(s) QCoreApplication::translate("rite", s)
+
+
+//================================================================
+/*! check that all bytes are ASCII digits.
+*/
+static bool is_digits( const char *p, int size )
+{
+  for( int i = 0; i < size; i++ ) {
+    if( p[i] < '0' || p[i] > '9' ) return false;
+  }
+  return true;
+}
+
+
+//================================================================
+/*! parse and validate a RITE file.
+
+  Checks the magic, binary version, declared size and the section
+  table, so that a broken file is found before the target is erased.
+
+  @param	data	file image.
+  @param	info	(out) parsed information.
+  @param	error	(out) reason, if not valid.
+  @retval	bool	true: valid
+*/
+bool rite_parse( const QByteArray &data, RiteInfo *info, QString *error )
+{
+  const char *p = data.constData();
+  bool has_irep = false;
+  int header_size;
+  quint32 offset;
+
+  *info = RiteInfo();
+  if( data.size() < 8 || memcmp( p, "RITE", 4 ) != 0 ) {
+    *error = TR("No RITE magic.");
+    return false;
+  }
+  if( !is_digits( p + 4, 4 )) {
+    *error = TR("Illegal RITE version.");
+    return false;
+  }
+
+  // the major version "00" (mruby 1.x, 2.x) has a CRC before the size.
+  header_size = (memcmp( p + 4, "00", 2 ) == 0) ? RITE_HEADER_SIZE_V0 : RITE_HEADER_SIZE;
+  if( data.size() < header_size + SECTION_HEADER_SIZE ) {
+    *error = TR("Too short for a RITE file. (%1 bytes)").arg(data.size());
+    return false;
+  }
+
+  info->version = data.left(8);
+  info->size = qFromBigEndian<quint32>( p + header_size - 12 );
+  info->compiler = data.mid( header_size - 8, 8 );
+
+  if( info->size != quint32(data.size()) ) {
+    *error = TR("Size mismatch. (header %1, file %2 bytes)").arg(info->size).arg(data.size());
+    return false;
+  }
+
+  // walk the sections.
+  offset = header_size;
+  while( 1 ) {
+    if( info->size - offset < SECTION_HEADER_SIZE ) {
+      *error = TR("Truncated section header at %1.").arg(offset);
+      return false;
+    }
+
+    RiteSection sec;
+    sec.ident = data.mid( offset, 4 );
+    sec.offset = offset;
+    sec.size = qFromBigEndian<quint32>( p + offset + 4 );
+    if( sec.size < SECTION_HEADER_SIZE || sec.size > info->size - offset ) {
+      *error = TR("Illegal section size at %1.").arg(offset);
+      return false;
+    }
+    info->sections.append( sec );
+    offset += sec.size;
+
+    if( sec.ident == QByteArray("IREP") ) has_irep = true;
+    if( sec.ident == QByteArray("END\0", 4) ) break;
+  }
+
+  if( offset != info->size ) {
+    *error = TR("Extra data after the END section.");
+    return false;
+  }
+  if( !has_irep ) {
+    *error = TR("No IREP section.");
+    return false;
+  }
+
+  return true;
+}
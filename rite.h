@@ -0,0 +1,43 @@
+/*! @file
+  @brief
+  RITE (.mrb) file header and section parser.
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+#ifndef RITE_H
+#define RITE_H
+
+#include <QByteArray>
+#include <QString>
+#include <QList>
+
+
+//================================================================
+/*! RITE section.
+*/
+struct RiteSection {
+  QByteArray ident;		//!< section identifier. (e.g. "IREP")
+  quint32 offset = 0;		//!< offset from the top of the file.
+  quint32 size = 0;		//!< section size including its header.
+};
+
+
+//================================================================
+/*! RITE file information.
+*/
+struct RiteInfo {
+  QByteArray version;		//!< "RITE" and the binary version. (e.g. "RITE0300")
+  QByteArray compiler;		//!< compiler name and version. (e.g. "MATZ0000")
+  quint32 size = 0;		//!< declared file size.
+  QList<RiteSection> sections;	//!< sections, in order.
+};
+
+bool rite_parse( const QByteArray &data, RiteInfo *info, QString *error );
+
+#endif
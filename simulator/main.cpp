@@ -0,0 +1,23 @@
+/*! @file
+  @brief
+  mruby/c target simulator for mrbwrite.
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+
+#include <QCoreApplication>
+
+#include "mrbsim.h"
+
+
+int main(int argc, char *argv[])
+{
+  MrbSim app(argc, argv);
+  return app.exec();
+}
@@ -0,0 +1,1371 @@
+/*! @file
+  @brief
+  mruby/c target simulator for mrbwrite.
+
+  The simulator opens a pseudo-terminal and behaves like a board
+  running example/mrbc_firm.c in the bytecode receive mode.
+  mrbwrite can be connected to the slave side of the pty.
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+
+#define APPLICATION_VERSION "1.0.0"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QSocketNotifier>
+#include <QFile>
+#include <QRegularExpression>
+#include <QDebug>
+
+#include "mrbsim.h"
+#include "crc32.h"
+
+#define VERBOSE(s) if( opt_verbose_ ) { qout_ << s << Qt::endl; }
+
+#define VERSION_STRING		"mruby/c v3.3 RITE0300 MRBW1.2"
+#define DEFAULT_EXTENSIONS	"baud zwrite hashprog bwrite mwrite crc read mrbw2"
+#define BAUD_TEST_PATTERN	"UUUUUUUU0123456789abcdefABCDEF"
+#define BAUD_TEST_TIMEOUT_MS	500
+#define BAUD_CONFIRM		"OK"
+#define BWRITE_STX		0x02
+#define BWRITE_MAX_BLOCKS	256
+#define BWRITE_TIMEOUT_MS	2000	// the same as the firmware. mrbwrite resends in half of it.
+#define MRBW2_SOH		0x01
+#define MRBW2_WINDOW		1024	// UART_SIZE_RXFIFO of the firmware.
+#define MRBW2_REPLY_SIZE	2048
+#define MRBW2_MAX_READ		1024
+#define MRBW2_MIN_PAYLOAD	256
+#define MRBW2_ESCAPE_GAP_MS	20	// quiet time around CR LF to leave the frame mode.
+#define MAX_LINE_SIZE		50
+#define IREP_START_ADDR		0x08060000	// for 'showprog' display.
+
+static const char RITE[4] = {'R','I','T','E'};
+static char link_path_[256];	//!< removed by the signal handler.
+static int reset_pipe_[2] = { -1, -1 };	//!< SIGUSR1 to the event loop.
+
+
+//! command table.
+const MrbSim::Command MrbSim::TBL_COMMANDS[] = {
+  {"help",	&MrbSim::cmd_help,	false,	false },
+  {"version",	&MrbSim::cmd_version,	false,	false },
+  {"reset",	&MrbSim::cmd_reset,	false,	false },
+  {"execute",	&MrbSim::cmd_execute,	false,	false },
+  {"clear",	&MrbSim::cmd_clear,	false,	false },
+  {"write",	&MrbSim::cmd_write,	false,	false },
+  {"showprog",	&MrbSim::cmd_showprog,	false,	false },
+  {"baud",	&MrbSim::cmd_baud,	true,	true },
+  {"zwrite",	&MrbSim::cmd_zwrite,	true,	true },
+  {"hashprog",	&MrbSim::cmd_hashprog,	true,	false },
+  {"bwrite",	&MrbSim::cmd_bwrite,	true,	true },
+  {"mwrite",	&MrbSim::cmd_mwrite,	true,	true },
+  {"crc",	&MrbSim::cmd_crc,	true,	false },
+  {"read",	&MrbSim::cmd_read,	true,	false },
+  {"mrbw2",	&MrbSim::cmd_mrbw2,	true,	true },
+  {"data",	&MrbSim::cmd_data,	false,	false },
+  {0, 0, false, false },
+};
+
+
+//================================================================
+/*! get the IREP file size from the RITE header.
+*/
+static unsigned int get_irep_size( const char *addr )
+{
+  unsigned int size = 0;
+  for( int i = 0; i < 4; i++ ) {
+    size = (size << 8) | (quint8)addr[8 + i];
+  }
+
+  return size;
+}
+
+
+//================================================================
+/*! signal handler. remove the --link symlink and exit.
+*/
+static void signal_handler( int )
+{
+  if( link_path_[0] ) unlink( link_path_ );
+  _exit( 0 );
+}
+
+
+//================================================================
+/*! signal handler. SIGUSR1 presses the reset button.
+*/
+static void reset_handler( int )
+{
+  char c = 0;
+  if( write( reset_pipe_[1], &c, 1 ) < 0 ) return;
+}
+
+
+//================================================================
+/*! constructor
+
+  @param	argc	command line size
+  @param	argv	pointer to command line options
+*/
+MrbSim::MrbSim( int argc, char *argv[] )
+  : QCoreApplication( argc, argv ),
+    qout_(stdout),
+    opt_baud_rate_(0),
+    opt_latency_(0),
+    opt_drop_rate_(0),
+    opt_corrupt_rate_(0),
+    buffer_size_(32768),
+    master_fd_(-1),
+    slave_fd_(-1),
+    read_notifier_(0),
+    write_notifier_(0),
+    reset_notifier_(0),
+    last_pump_us_(0),
+    rx_credit_(0),
+    tx_credit_(0),
+    old_baud_rate_(0),
+    state_(ST_COMMAND),
+    write_addr_(0),
+    action_(ACT_WRITE),
+    recv_size_(0),
+    data_size_(0),
+    count_(0),
+    block_size_(0),
+    n_received_(0),
+    write_size_(0),
+    write_offset_(0),
+    in_request_(false),
+    escape_(0),
+    last_rx_us_(0)
+{
+  setApplicationName("mrbsim");
+  setApplicationVersion(APPLICATION_VERSION);
+
+  /*
+    parse command line options.
+  */
+  QCommandLineParser parser;
+  parser.setApplicationDescription("mruby/c target simulator for mrbwrite. version " APPLICATION_VERSION);
+  parser.addHelpOption();
+  parser.addVersionOption();
+
+  QCommandLineOption linkOption("link",
+                                tr("Make a symbolic link to the pty with this name."),
+                                tr("path"));
+  parser.addOption(linkOption);
+
+  QCommandLineOption baudRateOption("baud",
+                                tr("Simulated baud rate. 0 is unlimited. (default 0)"),
+                                tr("speed"));
+  parser.addOption(baudRateOption);
+
+  QCommandLineOption latencyOption("latency",
+                                tr("Delay before each response. (ms)"), tr("ms"));
+  parser.addOption(latencyOption);
+
+  QCommandLineOption dropRateOption("drop-rate",
+                                tr("Probability to drop each received byte. (e.g. 0.0001)"),
+                                tr("rate"));
+  parser.addOption(dropRateOption);
+
+  QCommandLineOption corruptRateOption("corrupt-rate",
+                                tr("Probability to corrupt each received byte."),
+                                tr("rate"));
+  parser.addOption(corruptRateOption);
+
+  QCommandLineOption seedOption("seed",
+                                tr("Random seed for the fault injection."), tr("seed"));
+  parser.addOption(seedOption);
+
+  QCommandLineOption extensionsOption("extensions",
+                                tr("Extension commands to support. 'none' for a plain MRBW1.2 target.\n"
+                                   "(default '" DEFAULT_EXTENSIONS "')"),
+                                tr("list"));
+  parser.addOption(extensionsOption);
+
+  QCommandLineOption flashSizeOption("flash-size",
+                                tr("FLASH size for programs. (default 131072)"), tr("bytes"));
+  parser.addOption(flashSizeOption);
+
+  QCommandLineOption bufferSizeOption("buffer-size",
+                                tr("Receive buffer size. (default 32768)"), tr("bytes"));
+  parser.addOption(bufferSizeOption);
+
+  QCommandLineOption verboseOption("verbose", tr("Verbose mode."));
+  parser.addOption(verboseOption);
+
+  parser.process(*this);
+
+  opt_link_ = parser.value( linkOption );
+  if( parser.isSet( baudRateOption ) ) {
+    opt_baud_rate_ = parser.value( baudRateOption ).toInt();
+  }
+  if( parser.isSet( latencyOption ) ) {
+    opt_latency_ = parser.value( latencyOption ).toInt();
+  }
+  if( parser.isSet( dropRateOption ) ) {
+    opt_drop_rate_ = parser.value( dropRateOption ).toDouble();
+  }
+  if( parser.isSet( corruptRateOption ) ) {
+    opt_corrupt_rate_ = parser.value( corruptRateOption ).toDouble();
+  }
+  if( parser.isSet( seedOption ) ) {
+    random_.seed( parser.value( seedOption ).toUInt() );
+  } else {
+    random_.seed( QRandomGenerator::global()->generate() );
+  }
+
+  QString ext = parser.isSet( extensionsOption ) ?
+    parser.value( extensionsOption ) : QString(DEFAULT_EXTENSIONS);
+  extensions_ = ext.split(QRegularExpression("[ ,]"), Qt::SkipEmptyParts);
+  extensions_.removeAll("none");
+
+  int flash_size = 131072;
+  if( parser.isSet( flashSizeOption ) ) {
+    flash_size = parser.value( flashSizeOption ).toInt();
+  }
+  flash_.fill( '\xff', flash_size );
+  if( parser.isSet( bufferSizeOption ) ) {
+    buffer_size_ = parser.value( bufferSizeOption ).toInt();
+  }
+  opt_verbose_ = parser.isSet(verboseOption);
+
+  baud_rate_ = opt_baud_rate_;
+
+  pump_timer_.setTimerType( Qt::PreciseTimer );
+  connect( &pump_timer_, &QTimer::timeout, this, &MrbSim::pump );
+  timeout_timer_.setSingleShot( true );
+  connect( &timeout_timer_, &QTimer::timeout, this, &MrbSim::timeout );
+  escape_timer_.setSingleShot( true );
+  connect( &escape_timer_, &QTimer::timeout, this, &MrbSim::leave_frame_mode );
+
+  /*
+    start user program main function run()
+  */
+  QTimer::singleShot(0, this, SLOT(run()));
+}
+
+
+//================================================================
+/*! destructor
+*/
+MrbSim::~MrbSim()
+{
+  if( link_path_[0] ) unlink( link_path_ );
+  if( slave_fd_ >= 0 ) close( slave_fd_ );
+  if( master_fd_ >= 0 ) close( master_fd_ );
+}
+
+
+//================================================================
+/*! user main function
+
+*/
+void MrbSim::run()
+{
+  if( !open_pty() ) {
+    exit( 1 );
+    return;
+  }
+
+  const char *name = ptsname( master_fd_ );
+  if( !opt_link_.isEmpty() ) {
+    QByteArray link = QFile::encodeName( opt_link_ );
+    unlink( link.constData() );
+    if( symlink( name, link.constData() ) != 0 ) {
+      qout_ << tr("Can't make a link '") << opt_link_ << "'." << Qt::endl;
+      exit( 1 );
+      return;
+    }
+    qstrncpy( link_path_, link.constData(), sizeof(link_path_) );
+  }
+  signal( SIGINT, signal_handler );
+  signal( SIGTERM, signal_handler );
+  if( pipe( reset_pipe_ ) == 0 ) {
+    fcntl( reset_pipe_[0], F_SETFL, fcntl( reset_pipe_[0], F_GETFL ) | O_NONBLOCK );
+    reset_notifier_ = new QSocketNotifier( reset_pipe_[0], QSocketNotifier::Read, this );
+    connect( reset_notifier_, &QSocketNotifier::activated, this, &MrbSim::reset_board );
+    signal( SIGUSR1, reset_handler );
+  }
+
+  // the first line is the device name, for scripts.
+  qout_ << (opt_link_.isEmpty() ? QString(name) : opt_link_) << Qt::endl;
+  VERBOSE( tr("Extensions: ") << extensions_.join(' '));
+  VERBOSE( tr("FLASH %1 bytes, buffer %2 bytes.").arg(flash_.size()).arg(buffer_size_));
+
+  read_notifier_ = new QSocketNotifier( master_fd_, QSocketNotifier::Read, this );
+  connect( read_notifier_, &QSocketNotifier::activated, this, &MrbSim::read_pty );
+  write_notifier_ = new QSocketNotifier( master_fd_, QSocketNotifier::Write, this );
+  write_notifier_->setEnabled( false );
+  connect( write_notifier_, &QSocketNotifier::activated, this, &MrbSim::write_pty );
+
+  clock_.start();
+}
+
+
+//================================================================
+/*! open the pseudo-terminal.
+
+  The slave side is kept open by the simulator, so that the master
+  does not hang up while mrbwrite is not connected.
+*/
+bool MrbSim::open_pty()
+{
+  master_fd_ = posix_openpt( O_RDWR | O_NOCTTY );
+  if( master_fd_ < 0 ||
+      grantpt( master_fd_ ) != 0 || unlockpt( master_fd_ ) != 0 ) {
+    qout_ << tr("Can't open a pseudo-terminal. ") << strerror(errno) << Qt::endl;
+    return false;
+  }
+  fcntl( master_fd_, F_SETFL, fcntl( master_fd_, F_GETFL ) | O_NONBLOCK );
+
+  slave_fd_ = open( ptsname( master_fd_ ), O_RDWR | O_NOCTTY );
+  if( slave_fd_ < 0 ) {
+    qout_ << tr("Can't open the pty slave. ") << strerror(errno) << Qt::endl;
+    return false;
+  }
+
+  // no echo, no line editing until mrbwrite sets its own mode.
+  struct termios tio;
+  tcgetattr( slave_fd_, &tio );
+  cfmakeraw( &tio );
+  tcsetattr( slave_fd_, TCSANOW, &tio );
+
+  return true;
+}
+
+
+//================================================================
+/*! read from the pty, with the fault injection.
+*/
+void MrbSim::read_pty()
+{
+  char buf[4096];
+
+  while( 1 ) {
+    ssize_t n = read( master_fd_, buf, sizeof(buf) );
+    if( n <= 0 ) break;
+
+    for( ssize_t i = 0; i < n; i++ ) {
+      if( opt_drop_rate_ > 0 && random_.generateDouble() < opt_drop_rate_ ) {
+        VERBOSE( tr("FAULT: drop a byte."));
+        continue;
+      }
+      if( opt_corrupt_rate_ > 0 && random_.generateDouble() < opt_corrupt_rate_ ) {
+        VERBOSE( tr("FAULT: corrupt a byte."));
+        buf[i] ^= (char)(1 << random_.bounded(8));
+      }
+      rx_queue_.append( buf[i] );
+    }
+  }
+
+  kick();
+}
+
+
+//================================================================
+/*! write pending data to the pty.
+*/
+void MrbSim::write_pty()
+{
+  while( !tx_out_.isEmpty() ) {
+    ssize_t n = write( master_fd_, tx_out_.constData(), tx_out_.size() );
+    if( n <= 0 ) break;
+    tx_out_.remove( 0, n );
+  }
+
+  write_notifier_->setEnabled( !tx_out_.isEmpty() );
+}
+
+
+//================================================================
+/*! start the pump timer.
+*/
+void MrbSim::kick()
+{
+  if( pump_timer_.isActive() ) return;
+
+  last_pump_us_ = clock_.nsecsElapsed() / 1000;
+  rx_credit_ = tx_credit_ = 0;
+  pump_timer_.start( baud_rate_ > 0 ? 1 : 0 );
+}
+
+
+//================================================================
+/*! process received data and send responses at the simulated baud rate.
+
+  One character is 10 bits on the line. (8N1)
+*/
+void MrbSim::pump()
+{
+  int n_rx = rx_queue_.size();
+  int n_tx = tx_queue_.size();
+
+  if( baud_rate_ > 0 ) {
+    qint64 now = clock_.nsecsElapsed() / 1000;
+    double bytes = (now - last_pump_us_) * (baud_rate_ / 10.0) / 1000000;
+    double max_burst = qMax( 1.0, baud_rate_ / 10.0 / 100 );	// 10ms
+    last_pump_us_ = now;
+
+    rx_credit_ = qMin( rx_credit_ + bytes, max_burst );
+    tx_credit_ = qMin( tx_credit_ + bytes, max_burst );
+    n_rx = qMin( n_rx, (int)rx_credit_ );
+    n_tx = qMin( n_tx, (int)tx_credit_ );
+    rx_credit_ -= n_rx;
+    tx_credit_ -= n_tx;
+  }
+
+  if( n_rx > 0 ) {
+    QByteArray data = rx_queue_.left( n_rx );
+    rx_queue_.remove( 0, n_rx );
+    input( data.constData(), data.size() );
+  }
+
+  if( n_tx > 0 ) {
+    tx_out_.append( tx_queue_.left( n_tx ));
+    tx_queue_.remove( 0, n_tx );
+    write_pty();
+  }
+
+  if( rx_queue_.isEmpty() && tx_queue_.isEmpty() ) pump_timer_.stop();
+}
+
+
+//================================================================
+/*! send a response.
+
+  @param	s	response string.
+*/
+void MrbSim::send( const QByteArray &s )
+{
+  if( in_request_ ) {
+    // sent in the response frame. (truncated as the firmware does)
+    reply_.append( s.left( MRBW2_REPLY_SIZE - reply_.size() ));
+    return;
+  }
+
+  if( opt_latency_ <= 0 ) {
+    tx_queue_.append( s );
+    kick();
+    return;
+  }
+
+  QTimer::singleShot( opt_latency_, this, [this, s]() {
+    tx_queue_.append( s );
+    kick();
+  });
+}
+
+
+//================================================================
+/*! receive timeout.
+*/
+void MrbSim::timeout()
+{
+  switch( state_ ) {
+  case ST_BLOCKS:
+    VERBOSE( tr("Timeout."));
+    send("-ERR Timeout.\r\n");
+    break;
+
+  case ST_BAUD_TEST:
+    VERBOSE( tr("No test pattern. Back to %1 bps.").arg(old_baud_rate_));
+    baud_rate_ = old_baud_rate_;
+    break;
+
+  case ST_BAUD_CONFIRM:
+    VERBOSE( tr("No confirmation. Back to %1 bps.").arg(old_baud_rate_));
+    baud_rate_ = old_baud_rate_;
+    break;
+
+  case ST_FRAMES:
+    frame_.clear();		// drop the incomplete frame.
+    return;
+
+  default:
+    break;
+  }
+
+  state_ = ST_COMMAND;
+  line_.clear();
+}
+
+
+//================================================================
+/*! process received data.
+
+  @param	p	pointer to the data.
+  @param	size	data size.
+*/
+void MrbSim::input( const char *p, int size )
+{
+  while( size > 0 ) {
+    switch( state_ ) {
+    case ST_DATA: {
+      int n = qMin( size, recv_size_ - buffer_.size() );
+      buffer_.append( p, n );
+      p += n;
+      size -= n;
+      if( buffer_.size() == recv_size_ ) received();
+    } break;
+
+    case ST_BLOCKS:
+      timeout_timer_.start( BWRITE_TIMEOUT_MS );
+      input_frame( *p++ );
+      size--;
+      break;
+
+    case ST_FRAMES:
+      input_request( *p++ );
+      size--;
+      if( frame_.isEmpty() ) {
+        timeout_timer_.stop();
+      } else {
+        timeout_timer_.start( BWRITE_TIMEOUT_MS );
+      }
+      break;
+
+    default:
+      input_line( *p++ );
+      size--;
+      break;
+    }
+  }
+}
+
+
+//================================================================
+/*! receive a line.
+*/
+void MrbSim::input_line( char ch )
+{
+  if( ch != '\n' ) {
+    line_.append( ch );
+    if( line_.size() >= MAX_LINE_SIZE ) line_.clear();	// too long.
+    return;
+  }
+
+  QByteArray line = line_.trimmed();
+  line_.clear();
+
+  switch( state_ ) {
+  case ST_BAUD_TEST:
+    timeout_timer_.stop();
+    state_ = ST_COMMAND;
+    if( line != BAUD_TEST_PATTERN ) {
+      VERBOSE( tr("Wrong test pattern. Back to %1 bps.").arg(old_baud_rate_));
+      baud_rate_ = old_baud_rate_;
+      return;
+    }
+    send("+OK " BAUD_TEST_PATTERN "\r\n");
+    state_ = ST_BAUD_CONFIRM;
+    timeout_timer_.start( BAUD_TEST_TIMEOUT_MS );
+    return;
+
+  case ST_BAUD_CONFIRM:
+    timeout_timer_.stop();
+    state_ = ST_COMMAND;
+    if( line != BAUD_CONFIRM ) {
+      VERBOSE( tr("Not confirmed. Back to %1 bps.").arg(old_baud_rate_));
+      baud_rate_ = old_baud_rate_;
+      return;
+    }
+    send("+OK\r\n");
+    return;
+
+  case ST_RUNNING:
+    // the user program doesn't read the console. (until reset_board)
+    return;
+
+  default:
+    break;
+  }
+
+  command( line );
+}
+
+
+//================================================================
+/*! receive a bwrite frame.
+
+  frame: STX(0x02) seq(2) len(2) hdr_chk(1) data(len) crc32(4)
+*/
+void MrbSim::input_frame( char ch )
+{
+  if( frame_.isEmpty() && ch != BWRITE_STX ) return;
+  frame_.append( ch );
+
+  const quint8 *hdr = (const quint8 *)frame_.constData();
+  int n_blocks = received_.size();
+  int seq = 0, len = 0;
+  if( frame_.size() >= 6 ) {
+    seq = hdr[1] << 8 | hdr[2];
+    len = hdr[3] << 8 | hdr[4];
+  }
+
+  if( frame_.size() == 6 ) {
+    int last_len = recv_size_ - (n_blocks - 1) * block_size_;
+    if( (quint8)~(hdr[1] ^ hdr[2] ^ hdr[3] ^ hdr[4]) != hdr[5] ||
+        seq >= n_blocks ||
+        len != ((seq == n_blocks-1) ? last_len : block_size_) ) {
+      frame_.clear();
+    }
+    return;
+  }
+  if( frame_.size() < 6 + len + 4 ) return;
+
+  // complete frame.
+  const quint8 *crc = hdr + 6 + len;
+  quint32 c = crc[0] << 24 | crc[1] << 16 | crc[2] << 8 | crc[3];
+  if( !received_[seq] ) {
+    if( c != calc_crc32( frame_.constData() + 6, len ) ) {
+      VERBOSE( tr("NAK %1").arg(seq));
+      send( QString("-NAK %1\r\n").arg(seq).toLatin1() );
+      frame_.clear();
+      return;
+    }
+    buffer_.replace( seq * block_size_, len, frame_.constData() + 6, len );
+    received_[seq] = true;
+    n_received_++;
+  }
+  send( QString("+ACK %1\r\n").arg(seq).toLatin1() );
+  frame_.clear();
+
+  if( n_received_ == n_blocks ) {
+    timeout_timer_.stop();
+    received();
+  }
+}
+
+
+//================================================================
+/*! receive a request frame, and send the response frame. (MRBW2)
+
+  frame: SOH(0x01) seq(1) len(2) hdr_chk(1) payload(len) crc32(4)
+    hdr_chk = ~(seq ^ len[0] ^ len[1])
+
+  The payload is a command line, and NUL and data for 'data'.
+  CR LF alone, with a quiet time before and after it, returns to the
+  text mode. Other bytes out of a frame are discarded up to the next SOH.
+*/
+void MrbSim::input_request( char ch )
+{
+  qint64 now = clock_.nsecsElapsed() / 1000;
+  bool quiet = (now - last_rx_us_ >= MRBW2_ESCAPE_GAP_MS * 1000);
+  last_rx_us_ = now;
+  escape_timer_.stop();
+
+  if( frame_.isEmpty() ) {
+    if( quiet && ch == '\r' ) {
+      escape_ = 1;
+    } else if( escape_ == 1 && ch == '\n' ) {
+      escape_ = 2;
+      escape_timer_.start( MRBW2_ESCAPE_GAP_MS );
+    } else {
+      escape_ = 0;
+    }
+    if( ch != MRBW2_SOH ) return;
+  }
+  escape_ = 0;
+  frame_.append( ch );
+
+  const quint8 *hdr = (const quint8 *)frame_.constData();
+  int len = 0;
+  if( frame_.size() >= 5 ) len = hdr[2] << 8 | hdr[3];
+
+  if( frame_.size() == 5 ) {
+    if( (quint8)~(hdr[1] ^ hdr[2] ^ hdr[3]) != hdr[4] ||
+        len > buffer_size_ - MRBW2_REPLY_SIZE - 4 ) {
+      frame_.clear();
+    }
+    return;
+  }
+  if( frame_.size() < 5 + len + 4 ) return;
+
+  // complete frame. execute it, and collect the response.
+  quint8 seq = hdr[1];
+  const quint8 *crc = hdr + 5 + len;
+  quint32 c = quint32(crc[0]) << 24 | crc[1] << 16 | crc[2] << 8 | crc[3];
+  QByteArray payload = frame_.mid( 5, len );
+  frame_.clear();
+
+  reply_.clear();
+  in_request_ = true;
+  if( c != calc_crc32( payload.constData(), len ) ) {
+    VERBOSE( tr("Broken frame %1.").arg(seq));
+    if( write_size_ != 0 ) {
+      send( QString("-NAK %1\r\n").arg(write_offset_).toLatin1() );
+    } else {
+      send("-ERR CRC error.\r\n");
+    }
+  } else {
+    int nul = payload.indexOf('\0');
+    frame_data_ = (nul < 0) ? QByteArray() : payload.mid( nul + 1 );
+    command( (nul < 0) ? payload : payload.left( nul ));
+  }
+  if( !in_request_ ) return;		// reset.
+  in_request_ = false;
+
+  QByteArray frame;
+  frame.append( char(MRBW2_SOH) );
+  frame.append( char(seq) );
+  frame.append( char(reply_.size() >> 8) );
+  frame.append( char(reply_.size()) );
+  frame.append( char(~(frame[1] ^ frame[2] ^ frame[3])) );
+  frame.append( reply_ );
+  quint32 rc = calc_crc32( reply_.constData(), reply_.size() );
+  for( int i = 24; i >= 0; i -= 8 ) {
+    frame.append( char(rc >> i) );
+  }
+  send( frame );
+}
+
+
+//================================================================
+/*! CR LF alone has been received in the frame mode. back to the text mode.
+*/
+void MrbSim::leave_frame_mode()
+{
+  if( state_ != ST_FRAMES || escape_ != 2 || !frame_.isEmpty() ) return;
+
+  VERBOSE( tr("Text mode."));
+  state_ = ST_COMMAND;
+  write_size_ = 0;
+  escape_ = 0;
+  send("+OK mruby/c\r\n");
+}
+
+
+//================================================================
+/*! execute a command line.
+*/
+void MrbSim::command( const QByteArray &line )
+{
+  QList<QByteArray> args = line.simplified().split(' ');
+  if( line.isEmpty() ) {
+    send("+OK mruby/c\r\n");
+    return;
+  }
+  VERBOSE( "> " << line );
+
+  for( const Command *cmd = TBL_COMMANDS; cmd->name; cmd++ ) {
+    if( args[0] != cmd->name ) continue;
+    if( cmd->extension && !extensions_.contains( cmd->name )) break;
+    if( cmd->text_only && state_ == ST_FRAMES ) {
+      send("-ERR Not available in the frame mode.\r\n");
+      return;
+    }
+
+    args.removeFirst();
+    (this->*cmd->function)( args );
+    return;
+  }
+
+  send("-ERR Illegal command. '" + args[0] + "'\r\n");
+}
+
+
+//================================================================
+/*! all data for the write commands are received.
+*/
+void MrbSim::received()
+{
+  state_ = ST_COMMAND;
+
+  switch( action_ ) {
+  case ACT_WRITE:
+    write_bytecode( buffer_ );
+    break;
+
+  case ACT_ZWRITE: {
+    /*
+      decompress LZSS. (same as the firmware)
+    */
+    const quint8 *p = (const quint8 *)buffer_.constData();
+    const quint8 *p_end = p + buffer_.size();
+    QByteArray out;
+    bool error = false;
+
+    while( p < p_end ) {
+      quint8 flags = *p++;
+      for( int i = 0; i < 8 && p < p_end; i++ ) {
+        if( flags & (1 << i) ) {		// literal
+          if( out.size() < data_size_ ) out.append( (char)*p ); else error = true;
+          p++;
+          continue;
+        }
+
+        if( p_end - p < 2 ) {			// match
+          p = p_end;
+          error = true;
+          break;
+        }
+        int dist = (p[0] | (p[1] >> 4) << 8) + 1;
+        int len = (p[1] & 0x0f) + 3;
+        p += 2;
+        if( dist > out.size() || len > data_size_ - out.size() ) {
+          error = true;
+          continue;
+        }
+        while( len-- > 0 ) {
+          out.append( out.at( out.size() - dist ));
+        }
+      }
+    }
+
+    if( error || out.size() != data_size_ ) {
+      send("-ERR Decompression error.\r\n");
+      break;
+    }
+    write_bytecode( out );
+  } break;
+
+  case ACT_MWRITE: {
+    // check all 'RITE' headers before writing.
+    int offset = 0;
+    QList<int> sizes;
+    for( int i = 0; i < count_; i++ ) {
+      if( offset + 12 > buffer_.size() ||
+          memcmp( buffer_.constData() + offset, RITE, sizeof(RITE)) != 0 ) {
+        send("-ERR No RITE code received.\r\n");
+        return;
+      }
+      sizes << get_irep_size( buffer_.constData() + offset );
+      offset += sizes.last();
+    }
+    if( offset != buffer_.size() ) {
+      send("-ERR Size mismatch.\r\n");
+      return;
+    }
+
+    offset = 0;
+    foreach( int size, sizes ) {
+      QByteArray data = buffer_.mid( offset, size );
+      data.append( -size & 3, '\xff' );	// align 4 byte.
+      if( !program_flash( data ) ) {
+        send("-ERR Flash write error.\r\n");
+        return;
+      }
+      offset += size;
+    }
+    VERBOSE( tr("Wrote %1 programs, %2 bytes.").arg(count_).arg(buffer_.size()));
+    send("+DONE\r\n");
+  } break;
+  }
+}
+
+
+//================================================================
+/*! program data to the simulated FLASH at write_addr_.
+
+  Like a real FLASH, programming can only clear bits.
+*/
+bool MrbSim::program_flash( const QByteArray &data )
+{
+  if( write_addr_ + data.size() > flash_.size() ) return false;
+
+  for( int i = 0; i < data.size(); i++ ) {
+    flash_[write_addr_ + i] = flash_.at(write_addr_ + i) & data.at(i);
+  }
+  write_addr_ += data.size();
+
+  return true;
+}
+
+
+//================================================================
+/*! write received bytecode to the simulated FLASH.
+*/
+void MrbSim::write_bytecode( const QByteArray &data )
+{
+  if( !data.startsWith( QByteArray( RITE, sizeof(RITE) ))) {
+    send("-ERR No RITE code received.\r\n");
+    return;
+  }
+
+  QByteArray d = data;
+  d.append( -data.size() & 3, '\xff' );	// align 4 byte.
+  if( !program_flash( d ) ) {
+    send("-ERR Flash write error.\r\n");
+    return;
+  }
+
+  VERBOSE( tr("Wrote %1 bytes.").arg(data.size()));
+  send("+DONE\r\n");
+}
+
+
+//================================================================
+/*! check the bytecode size for the write commands.
+
+  @param	size	bytecode size.
+  @param	stream	true if the command programs FLASH while receiving.
+			(the buffer size does not limit it)
+*/
+bool MrbSim::check_size( int size, bool stream )
+{
+  if( write_addr_ + size > flash_.size() || (!stream && size > buffer_size_) || size <= 0 ) {
+    send("-ERR IREP file size overflow.\r\n");
+    return false;
+  }
+
+  return true;
+}
+
+
+//================================================================
+/*! check the block size, and prepare to receive blocks.
+*/
+bool MrbSim::check_block_size( int size, int block_size )
+{
+  int n_blocks = (block_size > 0) ? (size + block_size - 1) / block_size : 0;
+  if( n_blocks <= 0 || n_blocks > BWRITE_MAX_BLOCKS ) {
+    send("-ERR Illegal block size.\r\n");
+    return false;
+  }
+
+  block_size_ = block_size;
+  received_.fill( false, n_blocks );
+  n_received_ = 0;
+  frame_.clear();
+
+  return true;
+}
+
+
+//================================================================
+/*! command 'help'
+*/
+void MrbSim::cmd_help( const QList<QByteArray> & )
+{
+  QByteArray s = "+OK\r\nCommands:\r\n";
+  for( const Command *cmd = TBL_COMMANDS; cmd->name; cmd++ ) {
+    if( cmd->extension && !extensions_.contains( cmd->name )) continue;
+    s += QByteArray("  ") + cmd->name + "\r\n";
+  }
+  send( s + "+DONE\r\n" );
+}
+
+
+//================================================================
+/*! command 'version'
+*/
+void MrbSim::cmd_version( const QList<QByteArray> & )
+{
+  QString s = VERSION_STRING;
+  if( !extensions_.isEmpty() ) s += " " + extensions_.join(' ');
+
+  send( "+OK " + s.toLatin1() + "\r\n" );
+}
+
+
+//================================================================
+/*! reset the board. (SIGUSR1)
+
+  Back to the sync window at the initial speed, in the text mode.
+*/
+void MrbSim::reset_board()
+{
+  char buf[16];
+  while( read( reset_pipe_[0], buf, sizeof(buf) ) > 0 ) {}
+
+  VERBOSE( tr("Reset."));
+  baud_rate_ = opt_baud_rate_;
+  state_ = ST_COMMAND;
+  rx_queue_.clear();
+  tx_queue_.clear();
+  line_.clear();
+  in_request_ = false;
+  escape_ = 0;
+  timeout_timer_.stop();
+  escape_timer_.stop();
+}
+
+
+//================================================================
+/*! command 'reset'
+
+  The board restarts, and waits for the host in the sync window.
+*/
+void MrbSim::cmd_reset( const QList<QByteArray> & )
+{
+  baud_rate_ = opt_baud_rate_;
+  state_ = ST_COMMAND;
+  in_request_ = false;		// no response frame. the board restarts.
+  send("+OK mruby/c\r\n");
+}
+
+
+//================================================================
+/*! command 'execute'
+
+  The simulated program runs, and ignores the input as the real
+  firmware does, until the board is reset. (SIGUSR1)
+*/
+void MrbSim::cmd_execute( const QList<QByteArray> & )
+{
+  send("+OK Execute mruby/c.\r\n");
+  state_ = ST_RUNNING;
+  VERBOSE( tr("Execute."));
+}
+
+
+//================================================================
+/*! command 'clear'
+*/
+void MrbSim::cmd_clear( const QList<QByteArray> &args )
+{
+  int keep = args.isEmpty() ? 0 : args[0].toInt();
+
+  // find the end of the programs to keep.
+  int addr = 0;
+  for( int i = 0; i < keep; i++ ) {
+    if( addr + 12 > flash_.size() ||
+        memcmp( flash_.constData() + addr, RITE, sizeof(RITE)) != 0 ) {
+      send("-ERR No such program.\r\n");
+      return;
+    }
+    unsigned int size = get_irep_size( flash_.constData() + addr );
+    addr += size + (-size & 3);	// align 4 byte.
+  }
+
+  // erase the rest.
+  if( addr < flash_.size() ) {
+    flash_.replace( addr, flash_.size() - addr, QByteArray( flash_.size() - addr, '\xff' ));
+  }
+  write_addr_ = addr;
+
+  VERBOSE( tr("Clear. keep %1 programs.").arg(keep));
+  send("+OK\r\n");
+}
+
+
+//================================================================
+/*! command 'write'
+*/
+void MrbSim::cmd_write( const QList<QByteArray> &args )
+{
+  if( args.isEmpty() ) {
+    send("-ERR\r\n");
+    return;
+  }
+
+  int size = args[0].toInt();
+  if( !check_size( size, true )) return;
+
+  send("+OK Write bytecode.\r\n");
+
+  // in the frame mode, the data comes in 'data' frames.
+  if( state_ == ST_FRAMES ) {
+    write_size_ = size;
+    write_offset_ = 0;
+    write_error_.clear();
+    return;
+  }
+
+  action_ = ACT_WRITE;
+  recv_size_ = size;
+  buffer_.clear();
+  state_ = ST_DATA;
+}
+
+
+//================================================================
+/*! command 'showprog'
+*/
+void MrbSim::cmd_showprog( const QList<QByteArray> & )
+{
+  QByteArray s = "idx size offset\r\n";
+  int addr = 0;
+  int n = 0;
+
+  while( addr + 12 <= flash_.size() &&
+         memcmp( flash_.constData() + addr, RITE, sizeof(RITE)) == 0 ) {
+    unsigned int size = get_irep_size( flash_.constData() + addr );
+    s += QString(" %1  %2 0x%3\r\n").arg(n++).arg(size, -4)
+      .arg(IREP_START_ADDR + addr, 8, 16, QChar('0')).toLatin1();
+    addr += size + (-size & 3);	// align 4 byte.
+  }
+
+  s += QString("total %1 / %2 (%3%)\r\n").arg(addr).arg(flash_.size())
+    .arg(100LL * addr / flash_.size()).toLatin1();
+  send( s + "+DONE\r\n" );
+}
+
+
+//================================================================
+/*! command 'baud'
+
+  The pty has no real speed. The new rate only changes the throttle,
+  if --baud is given.
+*/
+void MrbSim::cmd_baud( const QList<QByteArray> &args )
+{
+  if( args.isEmpty() ) {
+    send("-ERR\r\n");
+    return;
+  }
+
+  int baud = args[0].toInt();
+  if( baud <= 0 ) {
+    send("-ERR Illegal baud rate.\r\n");
+    return;
+  }
+
+  send("+OK\r\n");
+  old_baud_rate_ = baud_rate_;
+  if( opt_baud_rate_ > 0 ) baud_rate_ = baud;
+  state_ = ST_BAUD_TEST;
+  timeout_timer_.start( BAUD_TEST_TIMEOUT_MS );
+}
+
+
+//================================================================
+/*! command 'zwrite'
+*/
+void MrbSim::cmd_zwrite( const QList<QByteArray> &args )
+{
+  if( args.size() < 2 ) {
+    send("-ERR\r\n");
+    return;
+  }
+
+  int size = args[0].toInt();
+  int csize = args[1].toInt();
+  if( !check_size( size )) return;
+  if( csize <= 0 ) {
+    send("-ERR IREP file size overflow.\r\n");
+    return;
+  }
+
+  send("+OK Write compressed bytecode.\r\n");
+  action_ = ACT_ZWRITE;
+  data_size_ = size;
+  recv_size_ = csize;
+  buffer_.clear();
+  state_ = ST_DATA;
+}
+
+
+//================================================================
+/*! command 'hashprog'
+*/
+void MrbSim::cmd_hashprog( const QList<QByteArray> & )
+{
+  QByteArray s = "+OK\r\n";
+  int addr = 0;
+  int n = 0;
+
+  while( addr + 12 <= flash_.size() &&
+         memcmp( flash_.constData() + addr, RITE, sizeof(RITE)) == 0 ) {
+    unsigned int size = get_irep_size( flash_.constData() + addr );
+    if( addr + (qint64)size > flash_.size() ) break;
+
+    quint32 crc = calc_crc32( flash_.constData() + addr, size );
+    s += QString("%1 %2 %3\r\n").arg(n++).arg(size)
+      .arg(crc, 8, 16, QChar('0')).toLatin1();
+    addr += size + (-size & 3);	// align 4 byte.
+  }
+  send( s + "+DONE\r\n" );
+}
+
+
+//================================================================
+/*! command 'bwrite'
+*/
+void MrbSim::cmd_bwrite( const QList<QByteArray> &args )
+{
+  if( args.size() < 2 ) {
+    send("-ERR\r\n");
+    return;
+  }
+
+  int size = args[0].toInt();
+  if( !check_size( size )) return;
+  if( !check_block_size( size, args[1].toInt() )) return;
+
+  send("+OK Write bytecode.\r\n");
+  action_ = ACT_WRITE;
+  recv_size_ = size;
+  buffer_.fill( '\0', size );
+  state_ = ST_BLOCKS;
+  timeout_timer_.start( BWRITE_TIMEOUT_MS );
+}
+
+
+//================================================================
+/*! command 'mwrite'
+
+  mwrite (count) (total size) [block size]
+*/
+void MrbSim::cmd_mwrite( const QList<QByteArray> &args )
+{
+  if( args.size() < 2 ) {
+    send("-ERR\r\n");
+    return;
+  }
+
+  int count = args[0].toInt();
+  int size = args[1].toInt();
+  if( count <= 0 || !check_size( size + 3 * count )) return;
+  if( args.size() >= 3 && !check_block_size( size, args[2].toInt() )) return;
+
+  send("+OK Write bytecode.\r\n");
+  action_ = ACT_MWRITE;
+  count_ = count;
+  recv_size_ = size;
+  if( args.size() >= 3 ) {
+    buffer_.fill( '\0', size );
+    state_ = ST_BLOCKS;
+    timeout_timer_.start( BWRITE_TIMEOUT_MS );
+  } else {
+    buffer_.clear();
+    state_ = ST_DATA;
+  }
+}
+
+
+//================================================================
+/*! get the FLASH range of the 'crc' and 'read' commands.
+
+  @param	args	(offset) (size)
+  @param	offset	(out) offset from the top of the FLASH.
+  @param	size	(out) size.
+  @retval	bool	true: no error
+*/
+bool MrbSim::get_flash_range( const QList<QByteArray> &args, int *offset, int *size )
+{
+  if( args.size() < 2 ) {
+    send("-ERR\r\n");
+    return false;
+  }
+
+  *offset = args[0].toInt();
+  *size = args[1].toInt();
+  if( *offset < 0 || *size <= 0 || (qint64)*offset + *size > flash_.size() ) {
+    send("-ERR Out of range.\r\n");
+    return false;
+  }
+
+  return true;
+}
+
+
+//================================================================
+/*! command 'crc'
+*/
+void MrbSim::cmd_crc( const QList<QByteArray> &args )
+{
+  int offset, size;
+  if( !get_flash_range( args, &offset, &size )) return;
+
+  quint32 crc = calc_crc32( flash_.constData() + offset, size );
+  send( QString("+OK %1\r\n").arg(crc, 8, 16, QChar('0')).toLatin1() );
+}
+
+
+//================================================================
+/*! command 'read'
+*/
+void MrbSim::cmd_read( const QList<QByteArray> &args )
+{
+  int offset, size;
+  if( !get_flash_range( args, &offset, &size )) return;
+  if( state_ == ST_FRAMES && size > MRBW2_MAX_READ ) {
+    send("-ERR Too large for a frame.\r\n");
+    return;
+  }
+
+  send( "+OK\r\n" + flash_.mid( offset, size ) + "+DONE\r\n" );
+}
+
+
+//================================================================
+/*! command 'mrbw2'
+
+  Switch to the MRBW2 frame mode.
+  The reply is "+OK MRBW2 (window) (max payload)".
+*/
+void MrbSim::cmd_mrbw2( const QList<QByteArray> & )
+{
+  int max_payload = qMin( buffer_size_ - MRBW2_REPLY_SIZE - 4, 0xffff );
+  if( max_payload < MRBW2_MIN_PAYLOAD ) {
+    send("-ERR Buffer too small.\r\n");
+    return;
+  }
+
+  send( QString("+OK MRBW2 %1 %2\r\n").arg(MRBW2_WINDOW).arg(max_payload).toLatin1() );
+  VERBOSE( tr("Frame mode."));
+  state_ = ST_FRAMES;
+  frame_.clear();
+  escape_ = 0;
+  last_rx_us_ = clock_.nsecsElapsed() / 1000;
+}
+
+
+//================================================================
+/*! command 'data' (frame mode only)
+
+  data (offset) NUL (binary data)
+*/
+void MrbSim::cmd_data( const QList<QByteArray> &args )
+{
+  if( args.isEmpty() || state_ != ST_FRAMES || write_size_ == 0 ) {
+    send("-ERR Not writing.\r\n");
+    return;
+  }
+
+  int offset = args[0].toInt();
+  int len = frame_data_.size();
+  if( offset + len <= write_offset_ ) {
+    send("+OK\r\n");			// resent.
+    return;
+  }
+  if( offset != write_offset_ ) {
+    send( QString("-NAK %1\r\n").arg(write_offset_).toLatin1() );
+    return;
+  }
+  if( offset + len > write_size_ || ((len & 3) && offset + len < write_size_) ) {
+    write_size_ = 0;
+    send("-ERR Illegal data size.\r\n");
+    return;
+  }
+
+  // program the chunk. (same as the firmware)
+  if( write_error_.isEmpty() && offset == 0 &&
+      !frame_data_.startsWith( QByteArray( RITE, sizeof(RITE) ))) {
+    write_error_ = "-ERR No RITE code received.\r\n";
+  }
+  write_offset_ += len;
+  if( write_error_.isEmpty() ) {
+    QByteArray d = frame_data_;
+    d.append( -len & 3, '\xff' );	// align 4 byte.
+    if( !program_flash( d ) ) write_error_ = "-ERR Flash write error.\r\n";
+  }
+
+  if( write_offset_ < write_size_ ) {
+    send("+OK\r\n");
+    return;
+  }
+  write_size_ = 0;
+  if( !write_error_.isEmpty() ) {
+    send( write_error_ );
+    return;
+  }
+  VERBOSE( tr("Wrote %1 bytes.").arg(write_offset_));
+  send("+DONE\r\n");
+}
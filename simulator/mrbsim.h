@@ -0,0 +1,169 @@
+/*! @file
+  @brief
+  mruby/c target simulator for mrbwrite.
+
+  <pre>
+  Copyright (C) 2017- Kyushu Institute of Technology.
+  Copyright (C) 2017- Shimane IT Open-Innovation Center.
+
+  This file is distributed under BSD 3-Clause License.
+
+  </pre>
+*/
+#ifndef MRBSIM_H
+#define MRBSIM_H
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QTextStream>
+#include <QByteArray>
+#include <QVector>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+
+class QSocketNotifier;
+
+
+//================================================================
+/*! MrbSim class.
+
+  Simulates a target board running example/mrbc_firm.c on a
+  pseudo-terminal, so that mrbwrite can be run without hardware.
+*/
+class MrbSim : public QCoreApplication
+{
+  Q_OBJECT
+
+public:
+  MrbSim( int argc, char *argv[] );
+  ~MrbSim();
+
+public slots:
+  void run();
+
+private slots:
+  void read_pty();
+  void write_pty();
+  void pump();
+  void timeout();
+  void leave_frame_mode();
+  void reset_board();
+
+private:
+  //! receiver state.
+  enum State {
+    ST_COMMAND,			//!< waiting for a command line.
+    ST_DATA,			//!< receiving raw data.
+    ST_BLOCKS,			//!< receiving bwrite frames.
+    ST_BAUD_TEST,		//!< waiting for the baud rate test pattern.
+    ST_BAUD_CONFIRM,		//!< waiting for the confirmation of the new baud rate.
+    ST_FRAMES,			//!< receiving MRBW2 request frames.
+    ST_RUNNING,			//!< executing the user program.
+  };
+
+  //! what to do with the received data.
+  enum Action {
+    ACT_WRITE,			//!< write one bytecode.
+    ACT_ZWRITE,			//!< decompress and write one bytecode.
+    ACT_MWRITE,			//!< write several bytecodes.
+  };
+
+  //! command table entry.
+  struct Command {
+    const char *name;
+    void (MrbSim::*function)( const QList<QByteArray> &args );
+    bool extension;		//!< listed in the version reply.
+    bool text_only;		//!< reads raw data. not available in the frame mode.
+  };
+  static const Command TBL_COMMANDS[];
+
+  QTextStream qout_;		//!< console output stream.
+  bool opt_verbose_;		//!< command line option --verbose
+  int opt_baud_rate_;		//!< command line option --baud
+  int opt_latency_;		//!< command line option --latency
+  double opt_drop_rate_;	//!< command line option --drop-rate
+  double opt_corrupt_rate_;	//!< command line option --corrupt-rate
+  QString opt_link_;		//!< command line option --link
+  QStringList extensions_;	//!< command line option --extensions
+  int buffer_size_;		//!< command line option --buffer-size
+
+  int master_fd_;		//!< pseudo-terminal master.
+  int slave_fd_;		//!< pseudo-terminal slave, kept open.
+  QSocketNotifier *read_notifier_;
+  QSocketNotifier *write_notifier_;
+  QSocketNotifier *reset_notifier_;	//!< SIGUSR1. (reset button)
+  QRandomGenerator random_;	//!< for fault injection.
+
+  QTimer pump_timer_;		//!< paces the data at the simulated baud rate.
+  QTimer timeout_timer_;	//!< receive timeout.
+  QElapsedTimer clock_;
+  qint64 last_pump_us_;
+  double rx_credit_;		//!< bytes allowed to receive.
+  double tx_credit_;		//!< bytes allowed to send.
+  int baud_rate_;		//!< current simulated baud rate. (0: unlimited)
+  int old_baud_rate_;		//!< baud rate before 'baud' command.
+  QByteArray rx_queue_;		//!< received, not yet processed.
+  QByteArray tx_queue_;		//!< response, not yet sent.
+  QByteArray tx_out_;		//!< sent, not yet accepted by the pty.
+
+  State state_;
+  QByteArray line_;		//!< command line being received.
+  QByteArray flash_;		//!< simulated FLASH region.
+  int write_addr_;		//!< IREP file write point. (offset in flash_)
+
+  Action action_;
+  QByteArray buffer_;		//!< receive buffer.
+  int recv_size_;		//!< number of bytes to receive.
+  int data_size_;		//!< bytecode size. (zwrite)
+  int count_;			//!< number of bytecodes. (mwrite)
+  int block_size_;		//!< block size. (bwrite)
+  QVector<bool> received_;	//!< received blocks.
+  int n_received_;
+  QByteArray frame_;		//!< block frame being received.
+
+  int write_size_;		//!< program size of 'write' in the frame mode. (0: not writing)
+  int write_offset_;		//!< bytes received.
+  QByteArray write_error_;	//!< error response, or empty.
+  QByteArray frame_data_;	//!< binary data after the command line.
+  QByteArray reply_;		//!< response of the request frame.
+  bool in_request_;		//!< collecting the response in reply_.
+  int escape_;			//!< 1: CR after a quiet time, 2: and LF. (frame mode)
+  qint64 last_rx_us_;		//!< time of the last byte in the frame mode.
+  QTimer escape_timer_;		//!< quiet time after CR LF.
+
+  bool open_pty();
+  void input( const char *p, int size );
+  void input_line( char ch );
+  void input_frame( char ch );
+  void input_request( char ch );
+  void command( const QByteArray &line );
+  void received();
+  void send( const QByteArray &s );
+  void kick();
+
+  bool program_flash( const QByteArray &data );
+  void write_bytecode( const QByteArray &data );
+  bool check_size( int size, bool stream = false );
+  bool check_block_size( int size, int block_size );
+
+  void cmd_help( const QList<QByteArray> &args );
+  void cmd_version( const QList<QByteArray> &args );
+  void cmd_reset( const QList<QByteArray> &args );
+  void cmd_execute( const QList<QByteArray> &args );
+  void cmd_clear( const QList<QByteArray> &args );
+  void cmd_write( const QList<QByteArray> &args );
+  void cmd_showprog( const QList<QByteArray> &args );
+  void cmd_baud( const QList<QByteArray> &args );
+  void cmd_zwrite( const QList<QByteArray> &args );
+  void cmd_hashprog( const QList<QByteArray> &args );
+  void cmd_bwrite( const QList<QByteArray> &args );
+  void cmd_mwrite( const QList<QByteArray> &args );
+  bool get_flash_range( const QList<QByteArray> &args, int *offset, int *size );
+  void cmd_crc( const QList<QByteArray> &args );
+  void cmd_read( const QList<QByteArray> &args );
+  void cmd_mrbw2( const QList<QByteArray> &args );
+  void cmd_data( const QList<QByteArray> &args );
+};
+
+#endif
@@ -0,0 +1,21 @@
+######################################################################
+# mruby/c target simulator for mrbwrite.
+######################################################################
+
+TEMPLATE = app
+TARGET = mrbsim
+INCLUDEPATH += . ..
+
+# Input
+HEADERS += mrbsim.h ../crc32.h
+SOURCES += main.cpp mrbsim.cpp ../crc32.cpp
+
+
+#add
+QT -= gui
+CONFIG -= app_bundle
+CONFIG += console
+
+macx {
+    QMAKE_APPLE_DEVICE_ARCHS = x86_64 arm64
+}